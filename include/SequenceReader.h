@@ -25,13 +25,31 @@
 
 #include "cv.h"
 #include "SequenceExports.h"
+#include <vector>
 
 class SEQUENCES_EXPORT SequenceReader
 {
 public:
+  // is_color value that requests planar YUV 4:2:0 frames from the ffmpeg
+  // reader, as single-channel images of 3/2 the frame height (the other
+  // readers return color images)
+  enum { YUV420P = 256 };
+
   // static factory function that creates a derived reader that can read "filename"
   static SequenceReader * Create(const char * filename, int first, int last, int is_color);
 
+  // same as Create(), but the returned reader decodes the "n" frames that
+  // follow the last frame read in the background, using "n_threads" threads
+  // (each thread opens its own reader; use one thread for videos)
+  static SequenceReader * CreatePrefetch(const char * filename, int first, int last, int is_color,
+                                         int n, int n_threads=1);
+
+  // same as Create() (or CreatePrefetch() if n > 0), but the returned reader
+  // (a SequenceReaderCache) keeps up to max_bytes of recently read frames in
+  // memory, so that reading them again does not decode them again
+  static SequenceReader * CreateCache(const char * filename, int first, int last, int is_color,
+                                      size_t max_bytes, int n=0, int n_threads=1);
+
   // call this to destroy whatever was returned by Create()
   static void Destroy(SequenceReader ** reader);
 
@@ -43,6 +61,29 @@ public:
 
   // the returned image needs to be released by the caller!!
   virtual IplImage * Read(int pos)=0;
+
+  // reads the frame at pos into dst, which needs to have the size, depth,
+  // and number of channels of the images returned by Read(pos), so that the
+  // same image can be reused for all frames (a cv::Mat can be passed as an
+  // IplImage header); returns false if the frame cannot be read. Readers
+  // that can decode directly into dst override this.
+  virtual bool Read(int pos, IplImage * dst);
+
+  // reads frames first, first+step, ..., last (step > 0) into images[0],
+  // images[1], ... (frames that cannot be read are set to NULL) and returns
+  // the number of frames read; readers that can decode several frames at the
+  // same time override this. The returned images need to be released by the
+  // caller!!
+  virtual int ReadRange(int first, int last, int step, IplImage ** images);
+
+  // reads the frames at positions[0], ..., positions[n-1] into one block of
+  // memory: frame i is stored at dst + i * stride, with the size, depth, and
+  // number of channels of the images returned by Read() and without padding
+  // between rows (e.g., a contiguous N x H x W x C array). Frames are read
+  // in increasing order of position, so that videos and compressed archives
+  // are read in a single pass; frames that cannot be read are set to zero.
+  // Returns the number of frames read.
+  virtual int ReadBatch(const int * positions, int n, void * dst, size_t stride);
   
   // returns the actual start index
   virtual int First()=0;
@@ -56,7 +97,34 @@ public:
 
   virtual CvSize Size()=0;
 
+  // returns the closest frame at or before pos from which the reader can
+  // start reading without reading the frames before it (e.g., a keyframe of
+  // a video); image sequences can start at any frame
+  virtual int Keyframe(int pos) { return pos; }
+
   virtual ~SequenceReader(){};
+
+protected:
+  // decodes an encoded image into dst without allocating a new image (fails
+  // if the image does not match dst)
+  static bool DecodeImage(const uchar * data, size_t size, int is_color,
+                          IplImage * dst);
+
+  // reads the first frame (in the order of BatchOrder()) of a ReadBatch()
+  // call that can be read, and sets headers[j] to the frame
+  // positions[order[j]] in dst; returns the number of frames in "order" that
+  // were read or could not be read (frames before the one read are set to
+  // zero), or -1 if no frame can be read
+  int BatchHeaders(const int * positions, const std::vector<int> & order,
+                   void * dst, size_t stride, std::vector<IplImage> & headers);
+
+  // sets header to frame i of a block of frames in the format of image (see
+  // ReadBatch()); returns false if the frame does not fit in stride bytes
+  static bool BatchImage(const IplImage * image, void * dst, size_t stride,
+                         int i, IplImage * header);
+
+  // returns the indexes of positions[0], ..., positions[n-1] sorted by position
+  static std::vector<int> BatchOrder(const int * positions, int n);
 };
 
 #ifdef SEQUENCES_HEADER_ONLY
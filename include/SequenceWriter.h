@@ -29,7 +29,10 @@
 class SEQUENCES_EXPORT SequenceWriter
 {
 public: 
-  static SequenceWriter * Create(const char * filename, int fourcc, double fps, CvSize size, int is_color=1);
+  // level sets the compression level of compressed archives (-1: the
+  // SEQUENCES_COMPRESSION_LEVEL environment variable, or the compressor's
+  // default level)
+  static SequenceWriter * Create(const char * filename, int fourcc, double fps, CvSize size, int is_color=1, int level=-1);
 
   static void Destroy(SequenceWriter ** writer);
 
@@ -40,6 +43,20 @@ public:
   virtual void Close()=0;
 
   virtual void Write(CvArr * image, int pos=-1)=0;
+
+  // returns true if a frame could not be written since the sequence was
+  // opened (frames encoded in the background are checked once they are
+  // written)
+  virtual bool Failed() { return false; }
+
+  // encode frames in the background using n_threads threads (0: encode on
+  // the caller's thread); writers that cannot encode in parallel ignore this
+  virtual void SetThreads(int n_threads) {}
+
+  // appends the frames of a sequence written by another writer of the same
+  // type (e.g., a segment of the same output written by another thread)
+  // without encoding them again; returns false if the writer cannot do this
+  virtual bool Append(const char * filename) { return false; }
   
   virtual int Next()=0;
 
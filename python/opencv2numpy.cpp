@@ -63,6 +63,7 @@
 #include "numpy/arrayobject.h"
 #include "numpy/ndarrayobject.h"
 #include "opencv2/core/core.hpp"
+#include "SequenceBufferPool.h"
 using namespace cv;
 
 static int failmsg(const char *fmt, ...)
@@ -92,6 +93,16 @@ static inline int* refcountFromPyObject(const PyObject* obj)
     return (int*)((size_t)obj + REFCOUNT_OFFSET);
 }
 
+// returns the data of a numpy array to the buffer pool when the array is
+// deallocated (the capsule is the base object of the array)
+static void releasePoolBuffer(PyObject* capsule)
+{
+    SequenceBufferPool::Instance().Release(
+        (uchar*)PyCapsule_GetPointer(capsule, NULL));
+}
+
+// The data of the numpy arrays is allocated from the SequenceBufferPool, so
+// that frames of the same size reuse the same memory.
 class NumpyAllocator : public MatAllocator
 {
 public:
@@ -121,9 +132,22 @@ public:
             else*/
                 _sizes[dims++] = cn;
         }
-        PyObject* o = PyArray_SimpleNew(dims, _sizes, typenum);
+        size_t total = CV_ELEM_SIZE1(type);
+        for( i = 0; i < dims; i++ )
+            total *= (size_t)_sizes[i];
+        uchar* buffer = SequenceBufferPool::Instance().Acquire(MAX(total, (size_t)1));
+        PyObject* o = buffer ? PyArray_SimpleNewFromData(dims, _sizes, typenum, buffer) : NULL;
         if(!o)
+        {
+            SequenceBufferPool::Instance().Release(buffer);
             CV_Error_(CV_StsError, ("The numpy array of typenum=%d, ndims=%d can not be created", typenum, dims));
+        }
+        PyObject* capsule = PyCapsule_New(buffer, NULL, releasePoolBuffer);
+#if NPY_API_VERSION >= 0x00000007
+        PyArray_SetBaseObject((PyArrayObject*)o, capsule);
+#else
+        PyArray_BASE(o) = capsule;
+#endif
         refcount = refcountFromPyObject(o);
         npy_intp* _strides = PyArray_STRIDES(o);
         for( i = 0; i < dims - (cn > 1); i++ )
@@ -257,3 +281,18 @@ PyObject* pyopencv_from(const IplImage * img)
   Mat m(img);
   return pyopencv_from(m);
 }
+
+PyObject* pyopencv_create(IplImage * header, int width, int height, int depth,
+                          int channels)
+{
+  int type = depth == IPL_DEPTH_8U ? CV_8U : depth == IPL_DEPTH_8S ? CV_8S :
+             depth == IPL_DEPTH_16U ? CV_16U : depth == IPL_DEPTH_16S ? CV_16S :
+             depth == IPL_DEPTH_32S ? CV_32S : depth == IPL_DEPTH_32F ? CV_32F :
+             CV_64F;
+  Mat m;
+  m.allocator = &g_numpyAllocator;
+  m.create(height, width, CV_MAKETYPE(type, channels));
+  *header = m;
+  m.addref();
+  return pyObjectFromRefcount(m.refcount);
+}
@@ -29,5 +29,11 @@
 
 PyObject* pyopencv_from(const IplImage * img);
 
+// returns a new numpy array of height x width x channels elements of the
+// given IplImage depth, and sets header to its data, so that a frame can be
+// decoded directly into the array
+PyObject* pyopencv_create(IplImage * header, int width, int height, int depth,
+                          int channels);
+
 
 #endif // CV2NUMPY_H
@@ -18,11 +18,16 @@
 #
 import numpy as np
 cimport numpy as np
+import threading
 from libcpp cimport bool
 
 
 cdef extern from "cv.h":
-    ctypedef struct IplImage
+    ctypedef struct IplImage:
+        int nChannels
+        int depth
+        int width
+        int height
     cdef void cvReleaseImage(IplImage ** image)
     ctypedef struct c_CvSize "CvSize":
         int width
@@ -38,71 +43,261 @@ from cpython.ref cimport PyObject, Py_XINCREF, Py_XDECREF
 
 cdef extern from "opencv2numpy.h":
     cdef PyObject * pyopencv_from(IplImage * img)
+    cdef PyObject * pyopencv_create(IplImage * header, int width, int height,
+                                    int depth, int channels)
 
 
-cdef extern from "SequenceReader.h":
+# the GIL is released while the library reads, so that several threads can
+# read different sequences at the same time
+cdef extern from "SequenceReader.h" nogil:
     ctypedef struct c_Reader "SequenceReader":
         bool Open(char * filename, int first, int last, int is_color)
         void Close()
         IplImage * Read(int pos)
+        bool ReadInto "Read"(int pos, IplImage * dst)
+        int ReadBatch(int * positions, int n, void * dst, size_t stride)
         int First()
         int Last()
         int Next()
         c_CvSize Size()
 
 
-cdef extern from "SequenceReader.h" namespace "SequenceReader":
+cdef extern from "SequenceBufferPool.h":
+    ctypedef struct c_PoolStats "SequenceBufferPool::Stats":
+        size_t allocations
+        size_t reuses
+        size_t in_use
+        size_t high_water
+        size_t pooled
+    ctypedef struct c_BufferPool "SequenceBufferPool":
+        c_PoolStats GetStats()
+
+
+cdef extern from "SequenceBufferPool.h" namespace "SequenceBufferPool":
+    cdef c_BufferPool & Instance()
+
+
+def buffer_pool_stats():
+    """Statistics of the pool of frame buffers used by this module: the number
+    of buffers allocated from the heap and reused from the pool, the bytes in
+    use, the maximum bytes in use at the same time (high_water), and the bytes
+    kept in the pool for reuse."""
+    cdef c_PoolStats stats = Instance().GetStats()
+    return {'allocations': stats.allocations, 'reuses': stats.reuses,
+            'in_use': stats.in_use, 'high_water': stats.high_water,
+            'pooled': stats.pooled}
+
+
+cdef extern from "SequenceReader.h" namespace "SequenceReader" nogil:
     cdef c_Reader * Create(char * filename, int first,
         int last, int is_color)
+    cdef c_Reader * CreatePrefetch(char * filename, int first,
+        int last, int is_color, int n, int n_threads)
+    cdef c_Reader * CreateCache(char * filename, int first,
+        int last, int is_color, size_t max_bytes, int n, int n_threads)
     cdef void Destroy(c_Reader ** reader)
 
 
+cdef extern from "SequenceReaderCache.h":
+    ctypedef struct c_CacheStats "SequenceReaderCache::Stats":
+        size_t hits
+        size_t misses
+        size_t evictions
+        size_t frames
+        size_t bytes
+    ctypedef struct c_ReaderCache "SequenceReaderCache":
+        void Pin(int first, int last)
+        void Unpin()
+        void Clear()
+        c_CacheStats GetStats()
+
+
+# is_color value that reads videos as planar yuv420p frames (2D arrays of
+# 3/2 the frame height), e.g., for cv2.cvtColor(frame, cv2.COLOR_YUV2BGR_I420)
+# (videos with an odd width or height are read as bgr24 frames instead)
+YUV420P = 256
+
+
 cdef class SequenceReader(object):
     cdef c_Reader * thisptr
+    cdef c_ReaderCache * cacheptr
+    cdef IplImage format  # width, height, depth, channels of the last frame
+    cdef object lock  # the reader is used by one thread at a time
 
-    def __init__(self, filename, first=-1, last=-1, is_color=-1):
+    def __init__(self, filename, first=-1, last=-1, is_color=-1,
+                 prefetch=0, threads=1, cache_mb=0):
         """Open sequence specified by 'filename'. If first and last are set
         (not -1) then open only the subsequence first:last+1. The is_color
-        option is the same as in OpenCV: -1 don't care, 0 no, 1 yes."""
-        self.thisptr = Create(filename, first, last, is_color)
+        option is the same as in OpenCV: -1 don't care, 0 no, 1 yes (and
+        cv2.IMREAD_ANYDEPTH keeps 16-bit frames); YUV420P reads videos as
+        planar YUV. If prefetch > 0, the next 'prefetch' frames after each
+        read are decoded in the background by 'threads' threads (use 1 thread
+        for videos). If cache_mb > 0, up to 'cache_mb' MB of recently read
+        frames are kept, so that reading them again does not decode them
+        again (off by default, since each reader would keep its own frames).
+        The GIL is released while frames are read, so threads can read
+        different sequences in parallel; a reader shared by several threads
+        serves one of them at a time."""
+        cdef size_t max_bytes = <size_t>max(cache_mb, 0) << 20
+        cdef char * c_filename = filename
+        cdef int c_first = first, c_last = last, c_is_color = is_color
+        cdef int c_prefetch = prefetch, c_threads = threads
+        cdef c_Reader * reader
+        with nogil:
+            if max_bytes > 0:
+                reader = CreateCache(c_filename, c_first, c_last, c_is_color,
+                                     max_bytes, c_prefetch, c_threads)
+            elif c_prefetch > 0:
+                reader = CreatePrefetch(c_filename, c_first, c_last,
+                                        c_is_color, c_prefetch, c_threads)
+            else:
+                reader = Create(c_filename, c_first, c_last, c_is_color)
+        self.thisptr = reader
+        if max_bytes > 0:
+            self.cacheptr = <c_ReaderCache*>reader
         if self.thisptr == NULL:
             raise IOError('Could not open image sequence "%s"' % filename)
 
     def __cinit__(self):
         self.thisptr = NULL
+        self.cacheptr = NULL
+        self.format.depth = 0
+        self.lock = threading.RLock()
 
     def __dealloc__(self):        
-        Destroy(&self.thisptr)
+        self.cacheptr = NULL
+        with nogil:
+            Destroy(&self.thisptr)
 
     def read(self, index):
         """Read frame at index 'index'."""
-        cdef IplImage * frame = self.thisptr.Read(index)
+        with self.lock:
+            return self._read(index)
+
+    def _read(self, index):
+        cdef c_Reader * reader = self.thisptr
+        cdef int pos = index
+        cdef bool success
+        cdef IplImage * frame
+        cdef IplImage header
+
+        # once the frame format is known, decode directly into a new array
+        if self.format.depth != 0:
+            pyframe = <object>pyopencv_create(&header, self.format.width,
+                self.format.height, self.format.depth, self.format.nChannels)
+            # the returned pointer already has refcount==1 and the <object>
+            # cast increments it to 2; however, pyframe has the only reference
+            Py_XDECREF(<PyObject*>pyframe)
+            with nogil:
+                success = reader.ReadInto(pos, &header)
+            if success:
+                return pyframe
+            # frames outside the sequence are not read again; frames inside
+            # it may have another format (e.g., image sequences with gray and
+            # color images, or images of different sizes)
+            if pos < reader.First() or (reader.Last() >= 0 and
+                                        pos > reader.Last()):
+                raise IndexError('Cannot get frame %i.' % index)
+
+        # the first frame (or a frame of another format) is copied into an
+        # array to learn the format
+        with nogil:
+            frame = reader.Read(pos)
         if frame==NULL:
             raise IndexError('Cannot get frame %i.' % index)
         pyframe = <object>pyopencv_from(frame)
-        # the returned pointer already has refcount==1 and the <object> cast
-        # increments it to 2; however, pyframe has the only reference
         Py_XDECREF(<PyObject*>pyframe)
+        self.format.width = frame.width
+        self.format.height = frame.height
+        self.format.depth = frame.depth
+        self.format.nChannels = frame.nChannels
         cvReleaseImage(&frame)
         return pyframe
 
+    def read_batch(self, positions):
+        """Read the frames at 'positions' into a single array of shape
+        (N, height, width, channels), or (N, height, width) for single-channel
+        frames. The frames are read in increasing order of position, so that
+        videos and compressed archives are read in a single pass."""
+        cdef np.ndarray pos = np.array(positions, dtype=np.intc, ndmin=1)
+        cdef int n = pos.shape[0]
+        if n == 0:
+            raise ValueError('No frames requested.')
+        # the first frame read is the one at the smallest position, so that
+        # the other frames are read after it (it is swapped with frame 0,
+        # and swapped back once all frames are read)
+        cdef int i_min = int(np.argmin(pos))
+        pos[0], pos[i_min] = pos[i_min], pos[0]
+        cdef c_Reader * reader = self.thisptr
+        cdef np.ndarray batch
+        cdef size_t stride
+        cdef char * data
+        cdef int n_read = 1
+        with self.lock:
+            # the first frame determines the shape and type of the array
+            frame = self._read(pos[0])
+            batch = np.empty((n,) + frame.shape, dtype=frame.dtype)
+            batch[0] = frame
+            stride = frame.nbytes
+            data = batch.data
+            if n > 1:
+                with nogil:
+                    n_read += reader.ReadBatch(<int*>pos.data + 1, n - 1,
+                                               data + stride, stride)
+        if n_read < n:
+            raise IndexError('Cannot get %i of %i frames.' % (n - n_read, n))
+        if i_min != 0:
+            batch[[0, i_min]] = batch[[i_min, 0]]
+        return batch
+
+    def pin(self, first, last):
+        """Keep frames first..last (inclusive) in the frame cache once they
+        are read, even when newer frames would otherwise replace them."""
+        with self.lock:
+            if self.cacheptr != NULL:
+                self.cacheptr.Pin(first, last)
+
+    def unpin(self):
+        """Remove all ranges set by pin()."""
+        with self.lock:
+            if self.cacheptr != NULL:
+                self.cacheptr.Unpin()
+
+    def cache_stats(self):
+        """Statistics of the frame cache: the number of reads returned from
+        the cache (hits) and decoded (misses), the number of frames released
+        to stay within the cache size (evictions), and the frames and bytes
+        in the cache (None if the cache is disabled)."""
+        cdef c_CacheStats stats
+        if self.cacheptr == NULL:
+            return None
+        with self.lock:
+            stats = self.cacheptr.GetStats()
+        return {'hits': stats.hits, 'misses': stats.misses,
+                'evictions': stats.evictions, 'frames': stats.frames,
+                'bytes': stats.bytes}
+
     @property
     def first(self):
         """The index of the first frame."""
-        return self.thisptr.First()
+        with self.lock:
+            return self.thisptr.First()
 
     @property
     def last(self):
         """The index of the last frame (inclusive)."""
-        return self.thisptr.Last()
+        with self.lock:
+            return self.thisptr.Last()
 
     @property
     def shape(self):
         """Frame shape as a (height, width) tuple (currently excludes depth)."""
-        cdef c_CvSize size = self.thisptr.Size()
+        cdef c_CvSize size
+        with self.lock:
+            size = self.thisptr.Size()
         return (size.height, size.width)
 
     def __iter__(self):
-        for i in range(self.thisptr.First(), self.thisptr.Last() + 1):
+        for i in range(self.first, self.last + 1):
             yield i, self.read(i)
 
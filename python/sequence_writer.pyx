@@ -18,6 +18,7 @@
 #
 import numpy as np
 cimport numpy as np
+import threading
 from libcpp cimport bool
 
 
@@ -47,40 +48,62 @@ cdef extern from "opencv2numpy.h":
     cdef PyObject * pyopencv_from(IplImage * img)
 
 
-cdef extern from "SequenceWriter.h":
+# the GIL is released while the library writes, so that several threads can
+# write different sequences at the same time
+cdef extern from "SequenceWriter.h" nogil:
     ctypedef struct c_Writer "SequenceWriter":
         bool Open(char * filename, int fourcc, double fps, c_CvSize frame_size, int is_color)
         void Close()
         void Write(c_CvArr * image, int pos)
+        void SetThreads(int n_threads)
         int Next()
         #CvSize Size()
 
 
-cdef extern from "SequenceWriter.h" namespace "SequenceWriter":
+cdef extern from "SequenceWriter.h" namespace "SequenceWriter" nogil:
     cdef c_Writer * Create(char * filename, int fourcc,
-        int fps, c_CvSize size, int is_color)
+        int fps, c_CvSize size, int is_color, int level)
     cdef void Destroy(c_Writer ** writer)
 
 
 cdef class SequenceWriter:
     cdef c_Writer * thisptr
+    cdef object lock  # the writer is used by one thread at a time
 
-    def __init__(self, filename, fourcc=0, fps=30, shape=(0, 0), is_color=1):
+    def __init__(self, filename, fourcc=0, fps=30, shape=(0, 0), is_color=1,
+                 threads=0, level=-1):
         """Initialize the sequence writer. The arguments correspond
            to those found in OpenCV's VideoWriter C interface. The fourcc, fps,
-           and shape flags are used only by the OpenCV's VideoWriter.
+           and shape flags are used only by the OpenCV's VideoWriter. If
+           threads > 0, archive writers encode frames on that many background
+           threads (frames are still written in order). The level sets the
+           compression level of compressed archives (-1: the
+           SEQUENCES_COMPRESSION_LEVEL environment variable, or the
+           compressor's default). The GIL is released
+           while frames are encoded and written.
         """
         cdef c_CvSize csize
         csize.height, csize.width = shape
-        self.thisptr = Create(filename, fourcc, fps, csize, is_color)
+        cdef char * c_filename = filename
+        cdef int c_fourcc = fourcc, c_fps = fps, c_is_color = is_color
+        cdef int c_level = level
+        cdef c_Writer * writer
+        with nogil:
+            writer = Create(c_filename, c_fourcc, c_fps, csize, c_is_color,
+                            c_level)
+        self.thisptr = writer
         if self.thisptr == NULL:
             raise IOError('Could not open image sequence "%s"' % filename)
+        self.thisptr.SetThreads(threads)
 
     def __cinit__(self):
         self.thisptr = NULL
+        self.lock = threading.Lock()
 
     def __dealloc__(self):        
-        Destroy(&self.thisptr)
+        # finalizes the output file
+        with nogil:
+            Destroy(&self.thisptr)
 
     def write(self, np.ndarray[np.uint8_t, ndim=3, mode="c"] frame, index=-1):
         """Write a frame at the indended index in the video. If index==-1, then
@@ -89,10 +112,15 @@ cdef class SequenceWriter:
             raise ValueError('the third dimension of \'frame\' should be 1 or 3')
         cdef c_CvMat m = cvMat(frame.shape[0], frame.shape[1],
                              CV_8UC(frame.shape[2]), <void*>frame.data)
-        self.thisptr.Write(<c_CvArr*>&m, index)
+        cdef c_Writer * writer = self.thisptr
+        cdef int pos = index
+        with self.lock:
+            with nogil:
+                writer.Write(<c_CvArr*>&m, pos)
 
     @property
     def next(self):
         """The index of the next frame that will be written."""
-        return self.thisptr.Next()
+        with self.lock:
+            return self.thisptr.Next()
 
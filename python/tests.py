@@ -26,7 +26,7 @@ import os
 import subprocess
 import shutil
 import unittest
-from sequence_reader import SequenceReader
+from sequence_reader import SequenceReader, YUV420P
 from sequence_writer import SequenceWriter
 
 
@@ -132,6 +132,49 @@ def check_formats(inputs, nsamples=20, maxlength=500, seqonly=False):
         print('')
 
 
+def check_cache(filename, first, last, is_color, nsamples=20):
+    """Check that frames read again from the frame cache match the decoded
+       frames."""
+    r = SequenceReader(filename, first, last, is_color, cache_mb=0)
+    c = SequenceReader(filename, first, last, is_color, cache_mb=64)
+    frames = r.first + np.random.randint(r.last - r.first + 1, size=nsamples)
+    for f in np.concatenate([frames, frames[::-1]]):
+        if not np.array_equal(c.read(f), r.read(f)):
+            raise ValueError('Cached frame %i does not match' % f)
+    stats = c.cache_stats()
+    print('cache: %s' % stats)
+    if stats['hits'] < nsamples:
+        raise ValueError('Frames were not read from the cache')
+
+
+def check_batch(filename, first, last, is_color, nsamples=16):
+    """Check that a batch of frames matches the frames read one at a time."""
+    r = SequenceReader(filename, first, last, is_color, cache_mb=0)
+    frames = r.first + np.random.randint(r.last - r.first + 1, size=nsamples)
+    batch = r.read_batch(frames)
+    for i, f in enumerate(frames):
+        if not np.array_equal(batch[i], r.read(f)):
+            raise ValueError('Frame %i of the batch does not match' % f)
+
+
+def check_threads(outputs, nsamples=20):
+    """Check that sequences read by several threads at the same time (and one
+       reader shared by all threads) yield the same frames as serial reads."""
+    from multiprocessing.pool import ThreadPool
+    readers = [SequenceReader(fn, first, last, is_color, cache_mb=0)
+               for fmt, fn, first, last, is_color in outputs]
+    frames = readers[0].first + np.random.randint(
+        readers[0].last - readers[0].first + 1, size=nsamples)
+    serial = [get_video_hash(r, frames) for r in readers]
+    pool = ThreadPool(len(readers))
+    if pool.map(lambda r: get_video_hash(r, frames), readers) != serial:
+        raise ValueError('Frames read in parallel do not match')
+    if len(set(pool.map(lambda i: get_video_hash(readers[0], frames),
+                        range(len(readers))))) != 1:
+        raise ValueError('Frames of a shared reader do not match')
+    pool.close()
+
+
 def get_video_hash(reader, frames, subsample=100):
     """Returns an accumulated hash of the requested frames."""
     sha = hashlib.sha256()
@@ -221,6 +264,8 @@ class TestSequences(unittest.TestCase):
         formats = [
             ('tar', '.tar::frames_%06i.png'),
             ('tgz', '.tar.gz::frames_%06i.png'),
+            ('tzst', '.tar.zst::frames_%06i.png'),
+            ('tlz4', '.tar.lz4::frames_%06i.png'),
             ('png', '/frames_%06i.png')]
         max_frames_ffmpeg = 10  # max frames for checking ffmpeg determinism 
         check_determinism = False
@@ -254,10 +299,52 @@ class TestSequences(unittest.TestCase):
 
             # read all videos and compare hashes of all frames for various read orders
             check_formats([(fmt, filename, first, last, is_color),] + outputs)
+            check_cache(*outputs[0][1:])
+            for output in outputs:
+                check_batch(*output[1:])
+            check_threads(outputs)
 
             # delete output videos
             shutil.rmtree(TMP_DIR)
 
+    def test_odd_size_yuv420p(self):
+        """Test that yuv420p reads of a video with an odd width and height
+           stay aligned to the frames (they are read as bgr24 frames).
+        """
+        if not os.path.isdir(TMP_DIR):
+            os.makedirs(TMP_DIR)
+        filename = TMP_DIR + '/odd_size.mkv'
+        subprocess.check_call(
+            ['ffmpeg', '-y', '-v', 'error', '-f', 'lavfi', '-i',
+             'testsrc=size=33x17:rate=25', '-frames:v', '10', '-c:v', 'ffv1',
+             filename])
+        r = SequenceReader(filename, -1, -1, YUV420P)
+        c = SequenceReader(filename, -1, -1, 1)
+        self.assertEqual((r.first, r.last), (0, 9))
+        for f in range(r.first, r.last + 1):
+            self.assertTrue(np.array_equal(r.read(f), c.read(f)))
+        os.remove(filename)
+
+    def test_mixed_formats(self):
+        """Test that frames of an image sequence with different sizes and
+           numbers of channels are read in their own format.
+        """
+        if not os.path.isdir(TMP_DIR):
+            os.makedirs(TMP_DIR)
+        pattern = TMP_DIR + '/mixed_%06i.png'
+        frames = [np.full((16, 24, 3), 10, np.uint8),
+                  np.full((16, 24), 20, np.uint8),
+                  np.full((8, 12, 3), 30, np.uint8),
+                  np.full((8, 12, 3), 40, np.uint8)]
+        for f, frame in enumerate(frames):
+            cv2.imwrite(pattern % f, frame)
+        r = SequenceReader(pattern, 0, len(frames) - 1)
+        for f, frame in enumerate(frames):
+            self.assertTrue(np.array_equal(r.read(f).squeeze(), frame))
+        self.assertRaises(IndexError, r.read, len(frames))
+        for f in range(len(frames)):
+            os.remove(pattern % f)
+
 
 if __name__ == '__main__':
     main()
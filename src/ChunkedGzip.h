@@ -0,0 +1,135 @@
+//
+// File: ChunkedGzip.h
+// Purpose: Reads and writes gzip files that consist of several independently
+//   compressed members (chunks). Concatenated members are a valid gzip file
+//   (e.g., 'tar xzf' reads them).
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#ifndef CHUNKED_GZIP_H
+#define CHUNKED_GZIP_H
+
+#include "ChunkedStream.h"
+#include "zlib.h"
+#include <string.h>
+
+class ChunkedGzipWriter : public ChunkedWriter
+{
+public:
+  ChunkedGzipWriter()
+  {
+    memset(&m_z, 0, sizeof(m_z));
+  }
+
+  ~ChunkedGzipWriter()
+  {
+    Close();
+  }
+
+protected:
+  bool Init(int level)
+  {
+    // 16 + MAX_WBITS writes a gzip (instead of a zlib) header and trailer
+    return deflateInit2(&m_z, level < 0 ? Z_DEFAULT_COMPRESSION : level,
+                        Z_DEFLATED, 16 + MAX_WBITS, 8,
+                        Z_DEFAULT_STRATEGY) == Z_OK;
+  }
+
+  bool Compress(const void * data, size_t size, bool end)
+  {
+    m_z.next_in = (Bytef*)data;
+    do
+    {
+      uInt n = (uInt)MIN(size, (size_t)1 << 30);
+      m_z.avail_in = n;
+      size -= n;
+      int flush = (end && size == 0) ? Z_FINISH : Z_NO_FLUSH;
+      int r;
+      do
+      {
+        m_z.next_out = m_out;
+        m_z.avail_out = sizeof(m_out);
+        r = deflate(&m_z, flush);
+        if(r == Z_STREAM_ERROR ||
+           !Output(m_out, sizeof(m_out) - m_z.avail_out))
+          return false;
+      } while(m_z.avail_out == 0 || (flush == Z_FINISH && r != Z_STREAM_END));
+    } while(size > 0);
+    if(end)
+      deflateReset(&m_z);
+    return true;
+  }
+
+  void End()
+  {
+    deflateEnd(&m_z);
+  }
+
+private:
+  z_stream m_z;
+  Bytef m_out[1 << 16];
+};
+
+class ChunkedGzipReader : public ChunkedReader
+{
+public:
+  ChunkedGzipReader()
+  {
+    memset(&m_z, 0, sizeof(m_z));
+  }
+
+  ~ChunkedGzipReader()
+  {
+    Close();
+  }
+
+protected:
+  bool Init()
+  {
+    return inflateInit2(&m_z, 16 + MAX_WBITS) == Z_OK;
+  }
+
+  void Reset()
+  {
+    inflateReset(&m_z);
+  }
+
+  int Decompress(const uchar * in, size_t in_size, size_t * in_used,
+                 uchar * out, size_t out_size, size_t * out_used)
+  {
+    m_z.next_in = (Bytef*)in;
+    m_z.avail_in = (uInt)MIN(in_size, (size_t)1 << 30);
+    m_z.next_out = out;
+    m_z.avail_out = (uInt)MIN(out_size, (size_t)1 << 30);
+    uInt avail_in = m_z.avail_in, avail_out = m_z.avail_out;
+    int r = inflate(&m_z, Z_NO_FLUSH);
+    *in_used = avail_in - m_z.avail_in;
+    *out_used = avail_out - m_z.avail_out;
+    if(r == Z_STREAM_END)
+    {
+      inflateReset(&m_z);
+      return 1;
+    }
+    return (r == Z_OK || r == Z_BUF_ERROR) ? 0 : -1;
+  }
+
+  void End()
+  {
+    inflateEnd(&m_z);
+  }
+
+private:
+  z_stream m_z;
+};
+
+#endif // CHUNKED_GZIP_H
@@ -0,0 +1,273 @@
+//
+// File: ChunkedStream.h
+// Purpose: Base classes for compressed files that consist of several
+//   independently compressed chunks (gzip members, zstd frames, ...).
+//   Concatenated chunks are a valid compressed file, but a reader that knows
+//   where the chunks start can decompress any part of the file by
+//   decompressing a single chunk.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#ifndef CHUNKED_STREAM_H
+#define CHUNKED_STREAM_H
+
+#include "cv.h"  // for int64 and uchar
+#include <stdio.h>
+#include <utility>
+#include <vector>
+
+#ifdef WIN32
+#define fseeko _fseeki64
+#endif
+
+//
+// ChunkedWriter: compresses everything passed to Write() into the current
+// chunk; EndChunk() finishes the chunk, so that the next Write() starts a
+// new one. Derived classes implement the compression, and need to call
+// Close() in their destructors.
+//
+class ChunkedWriter
+{
+public:
+  ChunkedWriter() : m_fp(NULL), m_chunk_size(0) {}
+
+  virtual ~ChunkedWriter() {}
+
+  // level < 0 uses the default compression level
+  bool Open(const char * filename, int level = -1)
+  {
+    m_fp = fopen(filename, "wb");
+    if(m_fp == NULL)
+      return false;
+    if(!Init(level))
+    {
+      fclose(m_fp);
+      m_fp = NULL;
+      return false;
+    }
+    m_chunk_size = 0;
+    return true;
+  }
+
+  bool Write(const void * data, size_t size)
+  {
+    if(m_fp == NULL)
+      return false;
+    m_chunk_size += size;
+    return Compress(data, size, false);
+  }
+
+  // finish the current chunk (nothing is written if it is empty)
+  bool EndChunk()
+  {
+    if(m_fp == NULL || m_chunk_size == 0)
+      return m_fp != NULL;
+    m_chunk_size = 0;
+    return Compress(NULL, 0, true);
+  }
+
+  bool Close()
+  {
+    if(m_fp == NULL)
+      return false;
+    bool ok = EndChunk();
+    End();
+    ok = (fclose(m_fp) == 0) && ok;
+    m_fp = NULL;
+    return ok;
+  }
+
+  // number of threads used to compress each chunk (if supported)
+  virtual void SetThreads(int n_threads) {}
+
+protected:
+  virtual bool Init(int level) = 0;
+  // compress data into the current chunk, and finish the chunk if end is set
+  virtual bool Compress(const void * data, size_t size, bool end) = 0;
+  virtual void End() = 0;
+
+  bool Output(const void * data, size_t size)
+  {
+    return size == 0 || fwrite(data, 1, size, m_fp) == size;
+  }
+
+  FILE * m_fp;
+  size_t m_chunk_size;  // uncompressed bytes in the current chunk
+};
+
+//
+// ChunkedReader: decompresses a file sequentially (Read()), which also
+// records where each chunk starts, or at any offset (ReadAt()), which
+// decompresses the file starting at the chunk that contains the offset.
+// Derived classes implement the decompression, and need to call Close() in
+// their destructors.
+//
+class ChunkedReader
+{
+public:
+  // (compressed offset, uncompressed offset) of a chunk
+  typedef std::pair<int64, int64> Chunk;
+
+  ChunkedReader()
+    : m_fp(NULL), m_chunk(0), m_upos(0), m_in_pos(0), m_in_size(0),
+    m_in_end(0)
+  {}
+
+  virtual ~ChunkedReader() {}
+
+  // Open a compressed file. If the chunks are known (e.g., from an index),
+  // they can be provided; otherwise they are discovered by Read().
+  bool Open(const char * filename,
+            const std::vector<Chunk> & chunks = std::vector<Chunk>())
+  {
+    m_fp = fopen(filename, "rb");
+    if(m_fp == NULL)
+      return false;
+    if(!Init())
+    {
+      fclose(m_fp);
+      m_fp = NULL;
+      return false;
+    }
+    m_chunks = chunks;
+    if(m_chunks.empty())
+      m_chunks.push_back(Chunk(0, 0));
+    return Start(0);
+  }
+
+  void Close()
+  {
+    if(m_fp == NULL)
+      return;
+    End();
+    fclose(m_fp);
+    m_fp = NULL;
+    m_chunks.clear();
+  }
+
+  // read the next "size" uncompressed bytes (data may be NULL to skip them);
+  // returns the number of bytes read
+  size_t Read(uchar * data, size_t size)
+  {
+    uchar skip[1 << 14];
+    size_t total = 0;
+    while(total < size && m_fp != NULL)
+    {
+      if(m_in_pos == m_in_size)
+      {
+        m_in_pos = 0;
+        m_in_size = fread(m_in, 1, sizeof(m_in), m_fp);
+        m_in_end += m_in_size;
+        if(m_in_size == 0)
+          break;
+      }
+      size_t n = size - total;
+      if(data == NULL)
+        n = MIN(n, sizeof(skip));
+      size_t used = 0, produced = 0;
+      int r = Decompress(m_in + m_in_pos, m_in_size - m_in_pos, &used,
+                         data ? data + total : skip, n, &produced);
+      m_in_pos += used;
+      total += produced;
+      m_upos += produced;
+      if(r > 0)
+      {
+        // the next chunk (if any) starts right after this one
+        m_chunk++;
+        if(m_chunk == m_chunks.size())
+          m_chunks.push_back(Chunk(m_in_end - (m_in_size - m_in_pos), m_upos));
+      }
+      else if(r < 0)
+        break;  // corrupt data, or padding after the last chunk
+    }
+    return total;
+  }
+
+  // read "size" uncompressed bytes starting at uncompressed "offset"
+  bool ReadAt(int64 offset, uchar * data, size_t size)
+  {
+    if(m_fp == NULL)
+      return false;
+
+    // continue from the current position if it is in the same chunk
+    size_t i = Find(offset);
+    if(i != m_chunk || offset < m_upos)
+      if(!Start(i))
+        return false;
+    size_t skip = (size_t)(offset - m_upos);
+    return Read(NULL, skip) == skip && Read(data, size) == size;
+  }
+
+  // returns the chunks found so far (all of them, once Read() reaches the
+  // end of the file)
+  std::vector<Chunk> Chunks()
+  {
+    // the last "chunk" may only be the end of the file
+    std::vector<Chunk> chunks(m_chunks);
+    while(chunks.size() > 1 && chunks.back().second == m_upos &&
+          m_in_pos == m_in_size && feof(m_fp))
+      chunks.pop_back();
+    return chunks;
+  }
+
+protected:
+  virtual bool Init() = 0;
+  // prepare to decompress a new chunk
+  virtual void Reset() = 0;
+  // Decompress up to in_size bytes of "in" into up to out_size bytes of
+  // "out", and set the number of bytes used and produced. Returns 1 if the
+  // end of a chunk was reached, 0 if more data is needed, and -1 on error.
+  virtual int Decompress(const uchar * in, size_t in_size, size_t * in_used,
+                         uchar * out, size_t out_size, size_t * out_used) = 0;
+  virtual void End() = 0;
+
+private:
+  // returns the index of the chunk that contains uncompressed "offset"
+  size_t Find(int64 offset)
+  {
+    size_t i = 0;
+    while(i + 1 < m_chunks.size() && m_chunks[i + 1].second <= offset)
+      i++;
+    return i;
+  }
+
+  // start decompressing at the i-th chunk
+  bool Start(size_t i)
+  {
+    if(fseeko(m_fp, m_chunks[i].first, SEEK_SET) != 0)
+      return false;
+    clearerr(m_fp);
+    Reset();
+    m_chunk = i;
+    m_upos = m_chunks[i].second;
+    m_in_pos = 0;
+    m_in_size = 0;
+    m_in_end = m_chunks[i].first;
+    return true;
+  }
+
+  FILE * m_fp;
+  std::vector<Chunk> m_chunks;
+  size_t m_chunk;    // current chunk
+  int64 m_upos;      // current uncompressed offset
+  size_t m_in_pos;   // next compressed byte in m_in
+  size_t m_in_size;  // number of compressed bytes in m_in
+  int64 m_in_end;    // compressed offset of the end of m_in
+  uchar m_in[1 << 16];
+};
+
+#ifdef WIN32
+#undef fseeko
+#endif
+
+#endif // CHUNKED_STREAM_H
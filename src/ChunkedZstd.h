@@ -0,0 +1,134 @@
+//
+// File: ChunkedZstd.h
+// Purpose: Reads and writes zstd files that consist of several independently
+//   compressed frames (chunks). Concatenated frames are a valid zstd file
+//   (e.g., 'tar --zstd -xf' reads them).
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#ifndef CHUNKED_ZSTD_H
+#define CHUNKED_ZSTD_H
+
+#include "ChunkedStream.h"
+#include "zstd.h"
+
+class ChunkedZstdWriter : public ChunkedWriter
+{
+public:
+  ChunkedZstdWriter(int n_threads = 0)
+    : m_cctx(NULL), m_threads(n_threads)
+  {}
+
+  ~ChunkedZstdWriter()
+  {
+    Close();
+  }
+
+  // Large chunks are split into jobs that are compressed in parallel (if
+  // libzstd is built with multithreading support). The number of threads
+  // takes effect at the next chunk.
+  void SetThreads(int n_threads)
+  {
+    m_threads = n_threads;
+    if(m_cctx && m_chunk_size == 0)
+      ZSTD_CCtx_setParameter(m_cctx, ZSTD_c_nbWorkers, MAX(m_threads, 0));
+  }
+
+protected:
+  bool Init(int level)
+  {
+    m_cctx = ZSTD_createCCtx();
+    if(m_cctx == NULL)
+      return false;
+    ZSTD_CCtx_setParameter(m_cctx, ZSTD_c_compressionLevel,
+                           level < 0 ? ZSTD_CLEVEL_DEFAULT : level);
+    ZSTD_CCtx_setParameter(m_cctx, ZSTD_c_nbWorkers, MAX(m_threads, 0));
+    return true;
+  }
+
+  bool Compress(const void * data, size_t size, bool end)
+  {
+    ZSTD_inBuffer in = { data, size, 0 };
+    size_t remaining;
+    do
+    {
+      ZSTD_outBuffer out = { m_out, sizeof(m_out), 0 };
+      remaining = ZSTD_compressStream2(m_cctx, &out, &in,
+                                       end ? ZSTD_e_end : ZSTD_e_continue);
+      if(ZSTD_isError(remaining) || !Output(m_out, out.pos))
+        return false;
+    } while(end ? remaining != 0 : in.pos < in.size);
+    if(end)
+      ZSTD_CCtx_setParameter(m_cctx, ZSTD_c_nbWorkers, MAX(m_threads, 0));
+    return true;
+  }
+
+  void End()
+  {
+    ZSTD_freeCCtx(m_cctx);
+    m_cctx = NULL;
+  }
+
+private:
+  ZSTD_CCtx * m_cctx;
+  int m_threads;
+  char m_out[1 << 17];
+};
+
+class ChunkedZstdReader : public ChunkedReader
+{
+public:
+  ChunkedZstdReader() : m_dctx(NULL) {}
+
+  ~ChunkedZstdReader()
+  {
+    Close();
+  }
+
+protected:
+  bool Init()
+  {
+    m_dctx = ZSTD_createDCtx();
+    return m_dctx != NULL;
+  }
+
+  void Reset()
+  {
+    ZSTD_DCtx_reset(m_dctx, ZSTD_reset_session_only);
+  }
+
+  int Decompress(const uchar * in, size_t in_size, size_t * in_used,
+                 uchar * out, size_t out_size, size_t * out_used)
+  {
+    ZSTD_inBuffer zin = { in, in_size, 0 };
+    ZSTD_outBuffer zout = { out, out_size, 0 };
+    size_t r = ZSTD_decompressStream(m_dctx, &zout, &zin);
+    *in_used = zin.pos;
+    *out_used = zout.pos;
+    if(ZSTD_isError(r))
+      return -1;
+    // 0 means that a frame was completely decoded and flushed
+    return r == 0 ? 1 : 0;
+  }
+
+  void End()
+  {
+    ZSTD_freeDCtx(m_dctx);
+    m_dctx = NULL;
+  }
+
+private:
+  ZSTD_DCtx * m_dctx;
+};
+
+#endif // CHUNKED_ZSTD_H
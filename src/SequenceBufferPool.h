@@ -0,0 +1,257 @@
+//
+// File: SequenceBufferPool.h
+// Purpose: A pool of reusable memory buffers, bucketed by size, so that
+//   reading/writing a sequence frame by frame does not allocate and free the
+//   same amount of memory for every frame.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#ifndef SEQUENCE_BUFFER_POOL_H
+#define SEQUENCE_BUFFER_POOL_H
+
+#include "cv.h"
+#include <stdlib.h>
+#include <mutex>
+#include <vector>
+
+//
+// Buffer sizes are rounded up to one of four sizes per power of two (at
+// least 4 KB), so that a released buffer can be reused for any request that
+// rounds up to the same size. Released buffers are kept for reuse until the
+// pool holds max_pooled bytes; beyond that, they are freed.
+//
+class SequenceBufferPool
+{
+public:
+  struct Stats
+  {
+    size_t allocations;  // buffers allocated from the heap
+    size_t reuses;       // buffers reused from the pool
+    size_t in_use;       // bytes in buffers that have not been released
+    size_t high_water;   // maximum of in_use
+    size_t pooled;       // bytes in released buffers kept for reuse
+  };
+
+  SequenceBufferPool(size_t max_pooled)
+    : m_max_pooled(max_pooled), m_free(N_BUCKETS)
+  {
+    Stats stats = { 0, 0, 0, 0, 0 };
+    m_stats = stats;
+  }
+
+  ~SequenceBufferPool()
+  {
+    Trim();
+  }
+
+  // the pool shared by all readers and writers; it keeps up to the number of
+  // MB set by the SEQUENCES_BUFFER_POOL_MB environment variable (default:
+  // 512) in released buffers
+  static SequenceBufferPool & Instance()
+  {
+    static SequenceBufferPool pool(DefaultMaxPooled());
+    return pool;
+  }
+
+  static size_t DefaultMaxPooled()
+  {
+    const char * env = getenv("SEQUENCES_BUFFER_POOL_MB");
+    int mb = env ? atoi(env) : 512;
+    return (size_t)MAX(mb, 0) << 20;
+  }
+
+  // returns a buffer of at least size bytes (NULL if it cannot be allocated)
+  uchar * Acquire(size_t size)
+  {
+    int bucket = Bucket(size);
+    size_t capacity = Capacity(bucket);
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      AddInUse(capacity);
+      std::vector<uchar*> & buffers = m_free[bucket];
+      if(!buffers.empty())
+      {
+        uchar * data = buffers.back();
+        buffers.pop_back();
+        m_stats.reuses++;
+        m_stats.pooled -= capacity;
+        return data;
+      }
+      m_stats.allocations++;
+    }
+
+    // the bucket is stored in front of the buffer
+    uchar * block = (uchar*)malloc(HEADER + capacity);
+    if(block == NULL)
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stats.in_use -= capacity;
+      return NULL;
+    }
+    *(int*)block = bucket;
+    return block + HEADER;
+  }
+
+  // returns a buffer obtained from Acquire() to the pool
+  void Release(uchar * data)
+  {
+    if(data == NULL)
+      return;
+    int bucket = *(int*)(data - HEADER);
+    size_t capacity = Capacity(bucket);
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stats.in_use -= capacity;
+      if(m_stats.pooled + capacity <= m_max_pooled)
+      {
+        m_free[bucket].push_back(data);
+        m_stats.pooled += capacity;
+        return;
+      }
+    }
+    free(data - HEADER);
+  }
+
+  // returns the size of a buffer obtained from Acquire()
+  static size_t Capacity(const uchar * data)
+  {
+    return Capacity(*(const int*)(data - HEADER));
+  }
+
+  // creates a matrix whose data comes from the pool (release it with
+  // ReleaseMat())
+  CvMat * CreateMat(int rows, int cols, int type)
+  {
+    CvMat * mat = cvCreateMatHeader(rows, cols, type);
+    int step = cols * CV_ELEM_SIZE(type);
+    uchar * data = Acquire(MAX((size_t)rows * step, (size_t)1));
+    if(data == NULL)
+    {
+      cvReleaseMat(&mat);
+      return NULL;
+    }
+    cvSetData(mat, data, step);
+    return mat;
+  }
+
+  void ReleaseMat(CvMat ** mat)
+  {
+    if(mat == NULL || *mat == NULL)
+      return;
+    Release((*mat)->data.ptr);
+    cvReleaseMat(mat);  // the header only, since cvSetData() set the data
+  }
+
+  Stats GetStats()
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_stats;
+  }
+
+  // frees the released buffers
+  void Trim()
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for(size_t i = 0; i < m_free.size(); i++)
+    {
+      for(size_t j = 0; j < m_free[i].size(); j++)
+        free(m_free[i][j] - HEADER);
+      m_free[i].clear();
+    }
+    m_stats.pooled = 0;
+  }
+
+private:
+  // HEADER keeps the buffers aligned as the blocks returned by malloc()
+  enum { HEADER = 64, MIN_BITS = 12, N_BUCKETS = 4 * (64 - MIN_BITS) + 1 };
+
+  // bucket b holds buffers of 2^k * (4 + j) / 4 bytes, where
+  // k = MIN_BITS + b / 4 and j = b % 4
+  static size_t Capacity(int bucket)
+  {
+    return ((size_t)(4 + bucket % 4) << (MIN_BITS + bucket / 4)) >> 2;
+  }
+
+  // returns the smallest bucket whose buffers can hold size bytes
+  static int Bucket(size_t size)
+  {
+    if(size <= ((size_t)1 << MIN_BITS))
+      return 0;
+    int k = 0;
+    while(((size - 1) >> k) > 1)
+      k++;
+    // 2^k <= size - 1 < 2^(k+1), so q is 4, 5, 6, or 7
+    size_t q = (size - 1) >> (k - 2);
+    return 4 * (k - MIN_BITS) + (int)(q - 3);
+  }
+
+  void AddInUse(size_t size)
+  {
+    m_stats.in_use += size;
+    m_stats.high_water = MAX(m_stats.high_water, m_stats.in_use);
+  }
+
+  size_t m_max_pooled;
+  std::vector< std::vector<uchar*> > m_free;  // released buffers per bucket
+  Stats m_stats;
+  std::mutex m_mutex;
+};
+
+//
+// SequenceBuffer: a byte buffer whose memory comes from a SequenceBufferPool
+// (and is returned to it when the buffer is destroyed)
+//
+class SequenceBuffer
+{
+public:
+  SequenceBuffer(SequenceBufferPool & pool = SequenceBufferPool::Instance())
+    : m_pool(&pool), m_data(NULL), m_size(0)
+  {}
+
+  ~SequenceBuffer()
+  {
+    m_pool->Release(m_data);
+  }
+
+  // resizes the buffer (the contents are not preserved if it grows)
+  bool Resize(size_t size)
+  {
+    if(m_data == NULL || size > SequenceBufferPool::Capacity(m_data))
+    {
+      m_pool->Release(m_data);
+      m_data = size > 0 ? m_pool->Acquire(size) : NULL;
+    }
+    m_size = m_data ? size : 0;
+    return m_size == size;
+  }
+
+  uchar * Data()
+  {
+    return m_data;
+  }
+
+  size_t Size()
+  {
+    return m_size;
+  }
+
+private:
+  SequenceBuffer(const SequenceBuffer &);
+  SequenceBuffer & operator=(const SequenceBuffer &);
+
+  SequenceBufferPool * m_pool;
+  uchar * m_data;
+  size_t m_size;
+};
+
+#endif // SEQUENCE_BUFFER_POOL_H
@@ -0,0 +1,293 @@
+//
+// File: SequenceIndexCache.h
+// Purpose: Persists the index that a reader builds when it opens a file
+//   (frame count, frame size, archive entry offsets, video keyframes) in a
+//   sidecar file, so that reopening a file that has not changed is fast.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#ifndef SEQUENCE_INDEX_CACHE_H
+#define SEQUENCE_INDEX_CACHE_H
+
+#include "cv.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <utility>
+
+#ifdef WIN32
+#include <direct.h>
+#include <process.h>
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#define stat _stat64
+#else
+#include <unistd.h>
+#endif
+
+// The index of a file is stored in the user's cache directory
+// ($XDG_CACHE_HOME/sequences, ~/.cache/sequences, or
+// %LOCALAPPDATA%\sequences), named after the absolute path of the file. If
+// the SEQUENCES_INDEX_CACHE environment variable is set to a directory, the
+// index files are stored in that directory instead; if it is set to 0, the
+// cache is disabled. An index is used only if its version, reader type, and
+// the size and modification time of the indexed file match.
+class SequenceIndexCache
+{
+public:
+  enum { VERSION = 4 };
+
+  SequenceIndexCache(const char * filename, const char * type)
+    : m_type(type), m_file_size(-1), m_file_mtime(-1), m_last(-1),
+    m_size(cvSize(0, 0))
+  {
+    struct stat st;
+    if(filename && stat(filename, &st) == 0)
+    {
+      m_file_size = (int64)st.st_size;
+      m_file_mtime = (int64)st.st_mtime;
+      m_index_filename = IndexFilename(filename);
+    }
+  }
+
+  // returns the name of the index file for "filename" (empty if disabled)
+  static std::string IndexFilename(const char * filename)
+  {
+    std::string dir = CacheDirectory();
+    if(dir.empty())
+      return std::string();
+
+    // flatten the absolute path so that all index files fit in one directory
+    std::string name = AbsolutePath(filename);
+    for(size_t i = 0; i < name.size(); i++)
+      if(name[i] == '/' || name[i] == '\\' || name[i] == ':')
+        name[i] = '_';
+    return dir + "/" + name + ".seqidx";
+  }
+
+  // returns the directory of the index files, which is created if it does
+  // not exist (empty if the cache is disabled)
+  static std::string CacheDirectory()
+  {
+    const char * env = getenv("SEQUENCES_INDEX_CACHE");
+    if(env && strcmp(env, "0") == 0)
+      return std::string();
+    if(env && *env != '\0')
+      return std::string(env);
+
+#ifdef WIN32
+    const char * base = getenv("LOCALAPPDATA");
+    if(base == NULL || *base == '\0')
+      return std::string();
+    std::string dir = std::string(base) + "/sequences";
+    _mkdir(dir.c_str());
+#else
+    std::string dir;
+    const char * base = getenv("XDG_CACHE_HOME");
+    if(base && *base != '\0')
+      dir = base;
+    else if((base = getenv("HOME")) && *base != '\0')
+    {
+      dir = std::string(base) + "/.cache";
+      mkdir(dir.c_str(), 0755);
+    }
+    else
+      return std::string();
+    dir += "/sequences";
+    mkdir(dir.c_str(), 0755);
+#endif
+    return dir;
+  }
+
+  static std::string AbsolutePath(const char * filename)
+  {
+#ifdef WIN32
+    char * path = _fullpath(NULL, filename, 0);
+#else
+    char * path = realpath(filename, NULL);
+#endif
+    std::string name(path ? path : filename);
+    free(path);
+    return name;
+  }
+
+  // loads the index; returns false if there is no valid index for the file
+  bool Load()
+  {
+    if(m_index_filename.empty())
+      return false;
+    std::ifstream fi(m_index_filename.c_str());
+    if(!fi)
+      return false;
+
+    std::string line, key;
+    int version = -1;
+    std::string type;
+    int64 file_size = -1, file_mtime = -1;
+    if(!(fi >> key >> version) || key != "sequences-index" ||
+       version != VERSION ||
+       !(fi >> key >> type) || key != "type" || type != m_type ||
+       !(fi >> key >> file_size >> file_mtime) || key != "file" ||
+       file_size != m_file_size || file_mtime != m_file_mtime)
+      return false;
+
+    m_offsets.clear();
+    m_data_offsets.clear();
+    m_data_sizes.clear();
+    m_names.clear();
+    m_sequence_sizes.clear();
+    m_keyframes.clear();
+    m_chunks.clear();
+    while(std::getline(fi, line))
+    {
+      std::istringstream is(line);
+      if(!(is >> key))
+        continue;
+      if(key == "frames")
+        is >> m_last;
+      else if(key == "size")
+        is >> m_size.width >> m_size.height;
+      else if(key == "sequence")
+      {
+        // the key is the rest of the line (it may contain spaces)
+        CvSize size;
+        if(is >> size.width >> size.height && is.get() == ' ')
+        {
+          std::string name;
+          std::getline(is, name);
+          m_sequence_sizes[name] = size;
+        }
+      }
+      else if(key == "keyframe")
+      {
+        int frame;
+        double t;
+        if(is >> frame >> t)
+          m_keyframes[frame] = t;
+      }
+      else if(key == "chunk")
+      {
+        int64 offset, data_offset;
+        if(is >> offset >> data_offset)
+          m_chunks.push_back(std::make_pair(offset, data_offset));
+      }
+      else if(key == "entry")
+      {
+        // the entry name is the rest of the line (it may contain spaces)
+        int64 offset, data_offset, data_size;
+        if(is >> offset >> data_offset >> data_size && is.get() == ' ')
+        {
+          std::string name;
+          std::getline(is, name);
+          m_offsets.push_back(offset);
+          m_data_offsets.push_back(data_offset);
+          m_data_sizes.push_back(data_size);
+          m_names.push_back(name);
+        }
+      }
+      else if(key == "end")
+        return true;
+    }
+
+    // the index was truncated (e.g., a writer was interrupted)
+    return false;
+  }
+
+  // Writes the index to a temporary file that is then renamed to the index
+  // file, so that readers opening the same file at the same time never load
+  // a partially written index (errors are ignored--the cache is only an
+  // optimization).
+  void Save()
+  {
+    if(m_index_filename.empty())
+      return;
+    static std::atomic<int> n_saved(0);
+    std::ostringstream tmp;
+#ifdef WIN32
+    tmp << m_index_filename << ".tmp" << _getpid() << "_" << n_saved++;
+#else
+    tmp << m_index_filename << ".tmp" << getpid() << "_" << n_saved++;
+#endif
+    std::string tmp_filename = tmp.str();
+    std::ofstream fo(tmp_filename.c_str());
+    if(!fo)
+      return;
+    Write(fo);
+    fo.close();
+#ifdef WIN32
+    bool renamed = !fo.fail() && MoveFileExA(tmp_filename.c_str(),
+      m_index_filename.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    bool renamed = !fo.fail() &&
+      rename(tmp_filename.c_str(), m_index_filename.c_str()) == 0;
+#endif
+    if(!renamed)
+      remove(tmp_filename.c_str());
+  }
+
+  void Write(std::ostream & fo)
+  {
+    fo.precision(17);
+    fo << "sequences-index " << (int)VERSION << "\n";
+    fo << "type " << m_type << "\n";
+    fo << "file " << m_file_size << " " << m_file_mtime << "\n";
+    fo << "frames " << m_last << "\n";
+    fo << "size " << m_size.width << " " << m_size.height << "\n";
+    for(std::map<std::string, CvSize>::iterator it = m_sequence_sizes.begin();
+        it != m_sequence_sizes.end(); it++)
+      fo << "sequence " << it->second.width << " " << it->second.height
+         << " " << it->first << "\n";
+    for(std::map<int, double>::iterator it = m_keyframes.begin();
+        it != m_keyframes.end(); it++)
+      fo << "keyframe " << it->first << " " << it->second << "\n";
+    for(size_t i = 0; i < m_chunks.size(); i++)
+      fo << "chunk " << m_chunks[i].first << " " << m_chunks[i].second << "\n";
+    for(size_t i = 0; i < m_offsets.size(); i++)
+      fo << "entry " << m_offsets[i] << " " << m_data_offsets[i] << " "
+         << m_data_sizes[i] << " " << m_names[i] << "\n";
+    fo << "end\n";
+  }
+
+  std::string m_type;
+  std::string m_index_filename;
+  int64 m_file_size;
+  int64 m_file_mtime;
+
+  // cached index data
+  int m_last;                         // index of the last frame
+  CvSize m_size;                      // frame size
+  std::vector<int64> m_offsets;       // archive header offsets
+  std::vector<int64> m_data_offsets;  // archive entry data offsets
+  std::vector<int64> m_data_sizes;    // archive entry data sizes
+  std::vector<std::string> m_names;   // archive entry names
+  // frame sizes of the sequences in an archive (keyed by the first frame and
+  // the file pattern, see SequenceReaderArchive)
+  std::map<std::string, CvSize> m_sequence_sizes;
+  std::map<int, double> m_keyframes;  // video keyframe -> seek time
+  std::vector< std::pair<int64, int64> > m_chunks;  // gzip chunk offsets
+};
+
+#ifdef WIN32
+#undef stat
+#endif
+
+#endif // SEQUENCE_INDEX_CACHE_H
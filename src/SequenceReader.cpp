@@ -20,6 +20,14 @@
 #include "SequenceReaderArchive.h"
 #include "SequenceReaderFfmpeg.h"
 #include "SequenceReaderOffset.h"
+#include "SequenceReaderPrefetch.h"
+#include "SequenceReaderCache.h"
+#include <algorithm>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef USE_LIBAV  // reads videos in-process instead of piping from ffmpeg
+#include "SequenceReaderLibav.h"
+#endif
 #ifdef USE_VIDEO_OPENCV  // not frame accurate--use ffmpeg reader instead
 #include "SequenceReaderVideoOpenCv.h"
 #endif
@@ -27,6 +35,83 @@
 #include "SequenceReaderMultiPng.h"
 #endif
 
+#ifdef WIN32
+#define stat _stat64  // 64-bit file sizes
+#endif
+#ifndef S_ISREG
+#define S_ISREG(m) (((m) & S_IFMT) == S_IFREG)
+#define S_ISDIR(m) (((m) & S_IFMT) == S_IFDIR)
+#endif
+
+// readers that Create() tries for a file (see SniffReaders());
+// READ_ARCHIVE_LAST tries the archive reader after the video readers
+enum { READ_IMAGES = 1, READ_ARCHIVE = 2, READ_VIDEO = 4,
+       READ_ARCHIVE_LAST = 8 };
+
+// returns true if the first n bytes of a file are those of an archive (tar,
+// zip, 7z) or of a compressed file (gzip, bzip2, xz, zstd, lz4)
+static bool IsArchiveHeader(const unsigned char * data, size_t n)
+{
+  static const struct { const char * magic; size_t size; } headers[] = {
+    { "\x1f\x8b", 2 }, { "BZh", 3 }, { "\xfd" "7zXZ\0", 6 },
+    { "\x28\xb5\x2f\xfd", 4 }, { "\x04\x22\x4d\x18", 4 },
+    { "PK\x03\x04", 4 }, { "7z\xbc\xaf\x27\x1c", 6 } };
+  for(size_t i = 0; i < sizeof(headers) / sizeof(headers[0]); i++)
+    if(n >= headers[i].size &&
+       memcmp(data, headers[i].magic, headers[i].size) == 0)
+      return true;
+  return n >= 262 && memcmp(data + 257, "ustar", 5) == 0;
+}
+
+static bool HasArchiveExtension(const char * filename)
+{
+  static const char * extensions[] = {
+    ".tar", ".tgz", ".tar.gz", ".tbz2", ".tar.bz2", ".txz", ".tar.xz",
+    ".tzst", ".tar.zst", ".tar.lz4", ".zip" };
+  size_t len = strlen(filename);
+  for(size_t i = 0; i < sizeof(extensions) / sizeof(extensions[0]); i++)
+  {
+    size_t ext_len = strlen(extensions[i]);
+    if(len >= ext_len && strcmp(filename + len - ext_len, extensions[i]) == 0)
+      return true;
+  }
+  return false;
+}
+
+// Picks the readers that can read "filename" from its name and its first
+// bytes, so that Create() does not try readers that would fail only after
+// indexing (archive) or decoding (ffmpeg) a large file of another type. Only
+// the most common archive formats are recognized, so other files are still
+// given to the archive reader if the image and video readers fail (e.g., rar,
+// cpio, or iso9660 files).
+static int SniffReaders(const char * filename)
+{
+  // archive::pattern
+  if(strstr(filename, "::"))
+    return READ_ARCHIVE;
+
+  // frame patterns, URLs, and directories are not files
+  struct stat st;
+  if(stat(filename, &st) != 0 || S_ISDIR(st.st_mode))
+    return READ_IMAGES | READ_VIDEO;
+
+  // reading the header of a pipe or a device would consume it, so they are
+  // not sniffed and all readers are tried
+  if(!S_ISREG(st.st_mode))
+    return HasArchiveExtension(filename) ? READ_ARCHIVE :
+      READ_IMAGES | READ_ARCHIVE | READ_VIDEO;
+
+  FILE * fp = fopen(filename, "rb");
+  if(fp == NULL)
+    return READ_IMAGES | READ_VIDEO;
+  unsigned char header[512];
+  size_t n = fread(header, 1, sizeof(header), fp);
+  fclose(fp);
+  if(IsArchiveHeader(header, n) || HasArchiveExtension(filename))
+    return READ_ARCHIVE;
+  return READ_IMAGES | READ_VIDEO | READ_ARCHIVE_LAST;
+}
+
 
 SequenceReader * SequenceReader::Create(const char * filename, int first, int last, int is_color)
 {
@@ -35,6 +120,10 @@ SequenceReader * SequenceReader::Create(const char * filename, int first, int la
   if(!filename)
     return NULL;
 
+  // only the ffmpeg reader outputs yuv420p; the other readers decode images
+  // in color instead
+  int image_is_color = (is_color == YUV420P) ? 1 : is_color;
+
   // wrap the sequence in the "offset" wrapper to change indexes if desired
   reader = new SequenceReaderOffset();
   if(reader->Open(filename, first, last, is_color))
@@ -42,9 +131,12 @@ SequenceReader * SequenceReader::Create(const char * filename, int first, int la
   else
     delete reader;
 
+  int readers = SniffReaders(filename);
+
 #ifdef USE_MULTIPNG
   reader = new SequenceReaderMultiPng();
-  if(reader->Open(filename, first, last, is_color))
+  if((readers & READ_IMAGES) &&
+     reader->Open(filename, first, last, image_is_color))
     return reader;
   else
     delete reader;
@@ -52,17 +144,32 @@ SequenceReader * SequenceReader::Create(const char * filename, int first, int la
 
   // first try the file reader
   reader = new SequenceReaderMultiFile();
-  if(reader->Open(filename, first, last, is_color))
+  if((readers & READ_IMAGES) &&
+     reader->Open(filename, first, last, image_is_color))
     return reader;
   else
     delete reader;
 
   reader = new SequenceReaderArchive();
+  if((readers & READ_ARCHIVE) &&
+     reader->Open(filename, first, last, image_is_color))
+    return reader;
+  else
+    delete reader;
+
+  if(!(readers & READ_VIDEO))
+    return NULL;
+
+#ifdef USE_LIBAV
+  reader = new SequenceReaderLibav();
   if(reader->Open(filename, first, last, is_color))
     return reader;
   else
     delete reader;
+#endif
 
+  // the ffmpeg executable reads the videos that libav does not (or all
+  // videos, if the library is built without libav)
   reader = new SequenceReaderFfmpeg();
   if(reader->Open(filename, first, last, is_color))
     return reader;
@@ -72,15 +179,177 @@ SequenceReader * SequenceReader::Create(const char * filename, int first, int la
 #ifdef USE_VIDEO_OPENCV
   // The opencv video reader is still not frame accurate (as of OpenCV 2.3.1)
   reader = new SequenceReaderVideoOpenCv();
-  if(reader->Open(filename, first, last, is_color))
+  if(reader->Open(filename, first, last, image_is_color))
     return reader;
   else
     delete reader;
 #endif
 
+  // archives of formats that SniffReaders() does not recognize
+  reader = new SequenceReaderArchive();
+  if((readers & READ_ARCHIVE_LAST) &&
+     reader->Open(filename, first, last, image_is_color))
+    return reader;
+  else
+    delete reader;
+
+  return NULL;
+}
+
+SequenceReader * SequenceReader::CreatePrefetch(const char * filename, int first, int last, int is_color,
+                                                int n, int n_threads)
+{
+  if(!filename)
+    return NULL;
+
+  SequenceReader * reader = new SequenceReaderPrefetch(n, n_threads);
+  if(reader->Open(filename, first, last, is_color))
+    return reader;
+  else
+    delete reader;
+
   return NULL;
 }
 
+SequenceReader * SequenceReader::CreateCache(const char * filename, int first, int last, int is_color,
+                                             size_t max_bytes, int n, int n_threads)
+{
+  if(!filename)
+    return NULL;
+
+  SequenceReader * reader = new SequenceReaderCache(max_bytes, n, n_threads);
+  if(reader->Open(filename, first, last, is_color))
+    return reader;
+  else
+    delete reader;
+
+  return NULL;
+}
+
+int SequenceReader::ReadRange(int first, int last, int step, IplImage ** images)
+{
+  if(step <= 0)
+    return 0;
+  int n_read = 0;
+  for(int pos = first, i = 0; pos <= last; pos += step, i++)
+    if((images[i] = Read(pos)) != NULL)
+      n_read++;
+  return n_read;
+}
+
+int SequenceReader::ReadBatch(const int * positions, int n, void * dst, size_t stride)
+{
+  std::vector<int> order = BatchOrder(positions, n);
+  std::vector<IplImage> headers;
+  int k = BatchHeaders(positions, order, dst, stride, headers);
+  if(k < 0)
+    return 0;
+  int n_read = 1;
+  for(; k < n; k++)
+  {
+    if(Read(positions[order[k]], &headers[k]))
+      n_read++;
+    else
+      cvZero(&headers[k]);
+  }
+  return n_read;
+}
+
+int SequenceReader::BatchHeaders(const int * positions, const std::vector<int> & order,
+                                 void * dst, size_t stride, std::vector<IplImage> & headers)
+{
+  int n = (int)order.size();
+  if(n == 0 || dst == NULL)
+    return -1;
+
+  // the first frame that can be read determines the format of all frames
+  IplImage * image = NULL;
+  int k = 0;
+  while(k < n && image == NULL)
+    image = Read(positions[order[k++]]);
+  if(image == NULL)
+    return -1;
+
+  headers.resize(n);
+  bool fits = true;
+  for(int j = 0; j < n && fits; j++)
+    fits = BatchImage(image, dst, stride, order[j], &headers[j]);
+  if(fits)
+  {
+    cvCopy(image, &headers[k - 1]);
+    for(int j = 0; j < k - 1; j++)
+      cvZero(&headers[j]);
+  }
+  cvReleaseImage(&image);
+  return fits ? k : -1;
+}
+
+bool SequenceReader::BatchImage(const IplImage * image, void * dst, size_t stride,
+                                int i, IplImage * header)
+{
+  int step = image->width * image->nChannels * ((image->depth & 255) / 8);
+  if((size_t)step * image->height > stride)
+  {
+    printf("SequenceReader::ReadBatch: the frames do not fit in the stride.\n");
+    return false;
+  }
+  cvInitImageHeader(header, cvGetSize(image), image->depth, image->nChannels);
+  cvSetData(header, (uchar*)dst + (size_t)i * stride, step);
+  return true;
+}
+
+std::vector<int> SequenceReader::BatchOrder(const int * positions, int n)
+{
+  std::vector<int> order(MAX(n, 0));
+  for(int i = 0; i < n; i++)
+    order[i] = i;
+  std::stable_sort(order.begin(), order.end(), [positions](int a, int b) {
+    return positions[a] < positions[b];
+  });
+  return order;
+}
+
+bool SequenceReader::Read(int pos, IplImage * dst)
+{
+  IplImage * image = Read(pos);
+  if(image == NULL || dst == NULL)
+  {
+    cvReleaseImage(&image);
+    return false;
+  }
+  bool success = (image->width == dst->width && image->height == dst->height &&
+                  image->depth == dst->depth &&
+                  image->nChannels == dst->nChannels);
+  if(success)
+    cvCopy(image, dst);
+  else
+    printf("SequenceReader::Read: the frame does not match the image.\n");
+  cvReleaseImage(&image);
+  return success;
+}
+
+bool SequenceReader::DecodeImage(const uchar * data, size_t size, int is_color,
+                                 IplImage * dst)
+{
+  if(data == NULL || size == 0 || dst == NULL)
+    return false;
+
+  // the decoder writes into dst if the decoded image has the same size and
+  // type; otherwise, it allocates a new image
+  cv::Mat buffer(1, (int)size, CV_8U, (void*)data);
+  cv::Mat image = cv::cvarrToMat(dst);
+  const uchar * ptr = image.data;
+  cv::imdecode(buffer, is_color, &image);
+  if(image.empty())
+    return false;
+  if(image.data != ptr)
+  {
+    printf("SequenceReader::Read: the frame does not match the image.\n");
+    return false;
+  }
+  return true;
+}
+
 void SequenceReader::Destroy(SequenceReader ** reader)
 {
   if(reader && *reader)
@@ -23,18 +23,34 @@
 #define SEQUENCE_READER_ARCHIVE_H
 
 #include "SequenceReader.h"
+#include "SequenceIndexCache.h"
+#include "SequenceThreadPool.h"
+#include "SequenceBufferPool.h"
+#include "ChunkedGzip.h"
+#ifdef USE_ZSTD
+#include "ChunkedZstd.h"
+#endif
 #define LIBARCHIVE_STATIC
 #include "archive.h"
 #include "archive_entry.h"
 #include "cv.h"
 #include "highgui.h"
 #include <vector>
+#include <list>
 #include <map>
+#include <sstream>
 
 #ifdef WIN32
 #define snprintf _snprintf
 #include <io.h>
 #define lseek _lseeki64
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
 #endif
 
 class SequenceReaderArchive : public SequenceReader
@@ -42,7 +58,12 @@ class SequenceReaderArchive : public SequenceReader
 public:
   SequenceReaderArchive()
     : m_pos(0), m_apos(0), m_first(-1), m_last(-1),
-    m_is_color(-1), m_a(NULL), m_fp(NULL), m_size(cvSize(0,0))
+    m_is_color(-1), m_a(NULL), m_fp(NULL), m_size(cvSize(0,0)),
+    m_chunked(NULL), m_map(NULL), m_map_size(0), m_entry_pos(-1),
+    m_cache_bytes(0), m_cache_max(DefaultCacheBytes()), m_cache_all(false)
+#ifdef WIN32
+    , m_map_handle(NULL)
+#endif
   {}
 
   ~SequenceReaderArchive()
@@ -52,6 +73,10 @@ public:
 
   void Close()
   {
+    UnmapArchive();
+    delete m_chunked;
+    m_chunked = NULL;
+    m_chunks.clear();
     if(m_a)
       archive_read_free(m_a);
     if(m_fp)
@@ -65,6 +90,18 @@ public:
     m_is_color = -1;
     m_size = cvSize(0,0);
     m_seekable = false;
+    m_entry.Resize(0);
+    m_entry_pos = -1;
+    ClearCache();
+  }
+
+  // the size in MB of the cache of encoded entries set by the
+  // SEQUENCES_ARCHIVE_CACHE_MB environment variable (default: 64)
+  static size_t DefaultCacheBytes()
+  {
+    const char * env = getenv("SEQUENCES_ARCHIVE_CACHE_MB");
+    int mb = env ? atoi(env) : 64;
+    return (size_t)MAX(mb, 0) << 20;
   }
 
   int OpenArchive()
@@ -78,6 +115,81 @@ public:
     return archive_read_open_fd(m_a, fileno(m_fp), 10246);
   }
 
+  // Maps the whole archive into memory, so that the frames of a plain tar
+  // file can be decoded directly from the mapping (without seeking, reopening
+  // the archive, or copying the data).
+  bool MapArchive()
+  {
+#ifdef WIN32
+    HANDLE file = (HANDLE)_get_osfhandle(fileno(m_fp));
+    LARGE_INTEGER size;
+    if(!GetFileSizeEx(file, &size) || size.QuadPart == 0)
+      return false;
+    m_map_handle = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if(m_map_handle == NULL)
+      return false;
+    m_map = (const uchar*)MapViewOfFile(m_map_handle, FILE_MAP_READ, 0, 0, 0);
+    if(m_map == NULL)
+    {
+      CloseHandle(m_map_handle);
+      m_map_handle = NULL;
+      return false;
+    }
+    m_map_size = (int64)size.QuadPart;
+#else
+    struct stat st;
+    if(fstat(fileno(m_fp), &st) != 0 || st.st_size == 0)
+      return false;
+    void * map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED,
+                      fileno(m_fp), 0);
+    if(map == MAP_FAILED)
+      return false;
+    m_map = (const uchar*)map;
+    m_map_size = (int64)st.st_size;
+#endif
+    return true;
+  }
+
+  // read size bytes at offset from the archive file (without moving the file
+  // position that libarchive uses)
+  bool ReadAt(int64 offset, uchar * data, size_t size)
+  {
+#ifdef WIN32
+    // the file position is not shared with libarchive once the index exists
+    if(lseek(fileno(m_fp), offset, SEEK_SET) != offset)
+      return false;
+#endif
+    while(size > 0)
+    {
+#ifdef WIN32
+      int n = _read(fileno(m_fp), data, (unsigned int)MIN(size, (size_t)1 << 30));
+#else
+      ssize_t n = pread(fileno(m_fp), data, size, (off_t)offset);
+#endif
+      if(n <= 0)
+        return false;
+      data += n;
+      offset += n;
+      size -= (size_t)n;
+    }
+    return true;
+  }
+
+  void UnmapArchive()
+  {
+    if(m_map == NULL)
+      return;
+#ifdef WIN32
+    UnmapViewOfFile(m_map);
+    CloseHandle(m_map_handle);
+    m_map_handle = NULL;
+#else
+    munmap((void*)m_map, (size_t)m_map_size);
+#endif
+    m_map = NULL;
+    m_map_size = 0;
+  }
+
   bool Open(const char * filename, int first, int last, int is_color)
   {
     if(filename == NULL)
@@ -112,6 +224,7 @@ public:
     for(int i = 0; i < nfilters && m_seekable; i++)
       if(strcmp("none", archive_filter_name(m_a, i)) != 0)
         m_seekable = false;
+    const char * filter = nfilters == 2 ? archive_filter_name(m_a, 0) : "";
 
     bool open_success = false;
     m_first = MAX(first, 0);  // we do not allow negative indexes
@@ -120,23 +233,103 @@ public:
     m_apos = 0;
     m_is_color = is_color;
 
-    // create an archive index for seeking and to discover the # of frames
-    CreateIndex();
+    // create an archive index for seeking and to discover the # of frames,
+    // unless the archive has not changed since it was last indexed
+    SequenceIndexCache cache(filename, "archive");
+    bool cached = cache.Load();
+    if(cached)
+    {
+      m_indexes = cache.m_offsets;
+      m_data_offsets = cache.m_data_offsets;
+      m_data_sizes = cache.m_data_sizes;
+      m_chunks = cache.m_chunks;
+      for(size_t i = 0; i < cache.m_names.size(); i++)
+        m_name_map[cache.m_names[i]] = (int)i;
+      if(m_last == -1)
+        m_last = m_first + (int)m_indexes.size() - 1;
+    }
+    else if(!CreateChunkedIndex(filter, filename))
+      CreateIndex();
     // create a map from sequence index to archive index, if a filename
     // pattern is provided (i.e., if not all files are in the sequence)
     if(!m_pattern.empty())
       CreateIndexMap();
 
-    // try to open first frame of the video
-    IplImage * frame = Read(m_first);
-    if(frame != NULL)
+    // read plain tar files directly from memory
+    if(m_seekable)
+      MapArchive();
+
+    // read compressed files that consist of several chunks (e.g., written by
+    // SequenceWriterArchive) one chunk at a time
+    if(m_chunks.size() > 1)
+    {
+      m_chunked = NewChunkedReader(filter);
+      if(m_chunked && !m_chunked->Open(filename, m_chunks))
+      {
+        delete m_chunked;
+        m_chunked = NULL;
+      }
+    }
+
+    // keep the entries of a compressed archive that fits in the entry cache
+    // as they are skipped, so that the archive is only decompressed once
+    if(m_map == NULL && !m_data_sizes.empty())
+    {
+      int64 total = 0;
+      for(size_t i = 0; i < m_data_sizes.size(); i++)
+        total += m_data_sizes[i];
+      m_cache_all = m_cache_max > 0 && (uint64)total <= (uint64)m_cache_max;
+    }
+
+    // try to open first frame of the video (the cached frame size is used
+    // if the same sequence of the archive was opened before)
+    std::ostringstream key;
+    key << m_first << " " << m_pattern;
+    std::map<std::string, CvSize>::iterator cached_size =
+      cache.m_sequence_sizes.find(key.str());
+    bool size_cached = cached && cached_size != cache.m_sequence_sizes.end();
+    if(size_cached && cached_size->second.width > 0 && IsValid(m_first))
     {
       open_success = true;
-      m_size = cvGetSize(frame);
-      cvReleaseImage(&frame);
-    } 
+      m_size = cached_size->second;
+    }
     else
-      printf("SequenceReaderArchive::Open: could not open first frame.\n");
+    {
+      // get the frame size from the PNG or JPEG header of the first frame
+      // (other images are decoded), and keep the entry, so that reading the
+      // first frame does not read it from the archive again
+      size_t size = 0;
+      const uchar * data = ReadEntry(m_first, m_entry, &size);
+      if(data == m_entry.Data() && data != NULL)
+        m_entry_pos = m_first;
+      if(data != NULL && !ImageSize(data, size, &m_size))
+      {
+        IplImage * frame = Decode(data, size);
+        if(frame != NULL)
+          m_size = cvGetSize(frame);
+        cvReleaseImage(&frame);
+      }
+      open_success = m_size.width > 0;
+      if(!open_success)
+        printf("SequenceReaderArchive::Open: could not open first frame.\n");
+    }
+
+    // save the index for the next time the archive is opened
+    if(open_success && !(size_cached &&
+                         cached_size->second.width == m_size.width &&
+                         cached_size->second.height == m_size.height))
+    {
+      cache.m_offsets = m_indexes;
+      cache.m_data_offsets = m_data_offsets;
+      cache.m_data_sizes = m_data_sizes;
+      cache.m_chunks = m_chunks;
+      cache.m_names.assign(m_indexes.size(), std::string());
+      for(std::map<std::string, int>::iterator it = m_name_map.begin();
+          it != m_name_map.end(); it++)
+        cache.m_names[it->second] = it->first;
+      cache.m_sequence_sizes[key.str()] = m_size;
+      cache.Save();
+    }
     
     // if we extracted a file pattern from the filename, then we 
     // made a copy of the filename
@@ -154,6 +347,9 @@ public:
     struct archive_entry *entry;
     while (archive_read_next_header(m_a, &entry) == ARCHIVE_OK)
     {
+      // the data of the entry starts where the header(s) end
+      m_data_offsets.push_back(archive_filter_bytes(m_a, 0));
+      m_data_sizes.push_back(archive_entry_size(entry));
       archive_read_data_skip(m_a);
       m_name_map[archive_entry_pathname(entry)] = (int)m_indexes.size();
       m_indexes.push_back(archive_read_header_position(m_a));
@@ -166,6 +362,66 @@ public:
     OpenArchive();
   }
 
+  // returns a reader for files compressed by the given libarchive filter, if
+  // the files can consist of several independently compressed chunks
+  static ChunkedReader * NewChunkedReader(const char * filter)
+  {
+    if(strcmp(filter, "gzip") == 0)
+      return new ChunkedGzipReader();
+#ifdef USE_ZSTD
+    if(strcmp(filter, "zstd") == 0)
+      return new ChunkedZstdReader();
+#endif
+    return NULL;
+  }
+
+  // Indexes a compressed archive by decompressing it with a ChunkedReader,
+  // which also finds where the compressed chunks start. The entry offsets
+  // are then offsets into the decompressed archive. Returns false if the
+  // filter is not supported (the archive is not indexed).
+  bool CreateChunkedIndex(const char * filter, const char * filename)
+  {
+    ChunkedSource source;
+    source.reader = NewChunkedReader(filter);
+    if(source.reader == NULL)
+      return false;
+    source.buffer.resize(1 << 16);
+    bool success = false;
+    if(source.reader->Open(filename))
+    {
+      archive_read_free(m_a);
+      m_a = archive_read_new();
+      archive_read_support_filter_all(m_a);
+      archive_read_support_format_all(m_a);
+      success = (archive_read_open(m_a, &source, NULL, ChunkedRead, NULL) ==
+                 ARCHIVE_OK);
+      if(success)
+      {
+        CreateIndex();  // reopens the archive file when done
+        std::vector<ChunkedReader::Chunk> chunks = source.reader->Chunks();
+        if(chunks.size() > 1)
+          m_chunks = chunks;
+      }
+      else
+      {
+        rewind(m_fp);
+        OpenArchive();
+      }
+    }
+    delete source.reader;
+    return success;
+  }
+
+  // libarchive callback that reads the decompressed archive
+  static la_ssize_t ChunkedRead(struct archive * a, void * client,
+                                const void ** buffer)
+  {
+    ChunkedSource * source = (ChunkedSource*)client;
+    *buffer = &source->buffer[0];
+    return (la_ssize_t)source->reader->Read(&source->buffer[0],
+                                            source->buffer.size());
+  }
+
   // Assumes:
   //   m_first is set correctly (to some non-negative value)
   //   m_last is positive, and is an upper bound on the highest index (modified)
@@ -205,12 +461,16 @@ public:
       OpenArchive(); // close and reopen archive
     }
 
-    // seek forward to current position, if necessary
+    // seek forward to current position, if necessary (the entries that are
+    // skipped are cached if the whole archive fits in the cache)
     struct archive_entry *entry;
     while(apos > m_apos &&
       archive_read_next_header(m_a, &entry) == ARCHIVE_OK)
     {
-      archive_read_data_skip(m_a);
+      if(m_cache_all && m_cache.find(m_apos) == m_cache.end())
+        CacheEntry(m_apos, entry);
+      else
+        archive_read_data_skip(m_a);
       m_apos++;
     }
 
@@ -223,47 +483,317 @@ public:
     return true;
   }
 
+  // returns true if the frame at sequence position pos is in the archive
+  bool IsValid(int pos)
+  {
+    if(m_index_map.empty())
+      return pos >= 0 && pos < (int)m_indexes.size();
+    return m_index_map.find(pos) != m_index_map.end();
+  }
+
   // the returned image needs to be released by the caller!!
   IplImage * Read(int pos)
   {
-    IplImage * img = NULL;
-    if(m_a)
+    SequenceBuffer buffer;
+    size_t size = 0;
+    const uchar * data = ReadEntry(pos, buffer, &size);
+    return Decode(data, size);
+  }
+
+  // decodes the frame directly into dst (from the memory mapped archive, if
+  // it is mapped)
+  bool Read(int pos, IplImage * dst)
+  {
+    SequenceBuffer buffer;
+    size_t size = 0;
+    const uchar * data = ReadEntry(pos, buffer, &size);
+    return DecodeImage(data, size, m_is_color, dst);
+  }
+
+  // Reads the entries of all requested frames sequentially from the archive,
+  // and decodes them in parallel. Entries are read and decoded in batches to
+  // limit the memory used by the compressed data.
+  int ReadRange(int first, int last, int step, IplImage ** images)
+  {
+    if(step <= 0)
+      return 0;
+    SequenceThreadPool & pool = SequenceThreadPool::Instance();
+    const int batch = 4 * pool.Size();
+    int n = first <= last ? (last - first) / step + 1 : 0;
+    int n_read = 0;
+    std::vector<SequenceBuffer> buffers(MIN(batch, n));
+    std::vector<const uchar*> data(buffers.size());
+    std::vector<size_t> sizes(buffers.size());
+    for(int i0 = 0; i0 < n; i0 += batch)
+    {
+      int n_batch = MIN(batch, n - i0);
+      for(int i = 0; i < n_batch; i++)
+        data[i] = ReadEntry(first + (i0 + i) * step, buffers[i], &sizes[i]);
+      pool.ParallelFor(n_batch, [&](int i) {
+        images[i0 + i] = Decode(data[i], sizes[i]);
+      });
+      for(int i = 0; i < n_batch; i++)
+        n_read += images[i0 + i] != NULL;
+    }
+    return n_read;
+  }
+
+  // Reads the entries of the requested frames in increasing order of
+  // position (a single pass over the archive), and decodes them in parallel
+  // directly into dst, in batches as in ReadRange().
+  int ReadBatch(const int * positions, int n, void * dst, size_t stride)
+  {
+    std::vector<int> order = BatchOrder(positions, n);
+    std::vector<IplImage> headers;
+    int k = BatchHeaders(positions, order, dst, stride, headers);
+    if(k < 0)
+      return 0;
+    SequenceThreadPool & pool = SequenceThreadPool::Instance();
+    const int batch = 4 * pool.Size();
+    int n_read = 1;
+    std::vector<SequenceBuffer> buffers(MIN(batch, n - k));
+    std::vector<const uchar*> data(buffers.size());
+    std::vector<size_t> sizes(buffers.size());
+    std::vector<char> decoded(buffers.size());
+    for(int j0 = k; j0 < n; j0 += batch)
+    {
+      int n_batch = MIN(batch, n - j0);
+      for(int i = 0; i < n_batch; i++)
+        data[i] = ReadEntry(positions[order[j0 + i]], buffers[i], &sizes[i]);
+      pool.ParallelFor(n_batch, [&](int i) {
+        decoded[i] = DecodeImage(data[i], sizes[i], m_is_color, &headers[j0 + i]);
+      });
+      for(int i = 0; i < n_batch; i++)
+      {
+        if(decoded[i])
+          n_read++;
+        else
+          cvZero(&headers[j0 + i]);
+      }
+    }
+    return n_read;
+  }
+
+  // Returns the (encoded) archive entry of the frame at sequence position pos
+  // and sets its size. The entry points into the memory mapped archive, if it
+  // is mapped, or into "buffer" otherwise. Returns NULL if there is an error.
+  const uchar * ReadEntry(int pos, SequenceBuffer & buffer, size_t * size)
+  {
+    *size = 0;
+    if(!m_a)
+      return NULL;
+
+    // validate position argument
+    if(!IsValid(pos))
     {
-      // validate position argument
-      if((m_index_map.empty() && (pos < 0 || pos >= (int)m_indexes.size())) ||
-         (!m_index_map.empty() && m_index_map.find(pos) == m_index_map.end()))
+      printf("SequenceReaderArchive::Read: Bad frame position %i...\n", pos);
+      return NULL;
+    }
+
+    // the entry read by Open() (the archive position is not changed)
+    if(pos == m_entry_pos)
+    {
+      *size = m_entry.Size();
+      m_pos = pos + 1;
+      return m_entry.Data();
+    }
+
+    // get the archive pos from the sequence pos
+    int apos = m_index_map.empty() ? pos : m_index_map[pos];
+
+    // entries in the cache are copied, since the cache may release them
+    // while the data is still used (e.g., by ReadRange())
+    std::map<int, CachedEntry>::iterator it = m_cache.find(apos);
+    if(it != m_cache.end())
+    {
+      m_cache_lru.splice(m_cache_lru.begin(), m_cache_lru, it->second.lru);
+      *size = it->second.buffer->Size();
+      if(!buffer.Resize(*size))
       {
-        printf("SequenceReaderArchive::Read: Bad frame position %i...\n", pos);
+        *size = 0;
         return NULL;
       }
+      memcpy(buffer.Data(), it->second.buffer->Data(), *size);
+      m_pos = pos + 1;
+      return buffer.Data();
+    }
 
-      // get the archive pos from the sequence pos
-      int apos = m_index_map.empty() ? pos : m_index_map[pos];
-      if(!Seek(apos))
+    if(m_map)
+    {
+      if(apos >= (int)m_data_offsets.size() ||
+         m_data_offsets[apos] + m_data_sizes[apos] > m_map_size)
+      {
+        printf("SequenceReaderArchive::Read: entry %i is out of bounds!\n", apos);
         return NULL;
+      }
+      *size = (size_t)m_data_sizes[apos];
+      m_pos = pos + 1;
+      return m_map + m_data_offsets[apos];
+    }
 
-      // assume that the seek was successful
-      struct archive_entry * entry;
-      int r = archive_read_next_header(m_a, &entry);
-      if(r == ARCHIVE_OK)
+    // if a plain tar file could not be mapped, read the entry with a single
+    // positioned read instead of seeking and reopening the archive; for a
+    // chunked compressed file, decompress only the chunk(s) with the entry
+    if((m_seekable || m_chunked) && apos < (int)m_data_offsets.size())
+    {
+      *size = (size_t)m_data_sizes[apos];
+      if(*size == 0 || !buffer.Resize(*size) ||
+         !(m_chunked ? m_chunked->ReadAt(m_data_offsets[apos], buffer.Data(), *size) :
+           ReadAt(m_data_offsets[apos], buffer.Data(), *size)))
       {
-        size_t size = archive_entry_size(entry);
-        const uchar * buf = new uchar[size];
-        size_t size_read = archive_read_data(m_a, (void*)buf, size);
-        CvMat bufm = cvMat(size, 1, CV_8U, (void*)buf);
-        img = cvDecodeImage(&bufm, m_is_color);
-        delete [] buf;
-        m_pos = pos + 1;
-        m_apos = apos + 1;
+        printf("SequenceReaderArchive::Read: could not read entry %i!\n", apos);
+        *size = 0;
+        return NULL;
       }
-      else
+      CacheEntry(apos, buffer.Data(), *size);
+      m_pos = pos + 1;
+      return buffer.Data();
+    }
+
+    if(!Seek(apos))
+      return NULL;
+
+    // assume that the seek was successful
+    struct archive_entry * entry;
+    int r = archive_read_next_header(m_a, &entry);
+    if(r != ARCHIVE_OK)
+    {
+      printf("SequenceReaderArchive::Read: Header read error!\n");
+      printf("%s\n", archive_error_string(m_a));
+      return NULL;
+    }
+
+    *size = archive_entry_size(entry);
+    if(!buffer.Resize(*size))
+      *size = 0;
+    if(*size > 0)
+    {
+      archive_read_data(m_a, (void*)buffer.Data(), *size);
+      CacheEntry(apos, buffer.Data(), *size);
+    }
+    m_pos = pos + 1;
+    m_apos = apos + 1;
+    return *size > 0 ? buffer.Data() : NULL;
+  }
+
+  // Keeps a copy of the entry at archive position apos in the cache, and
+  // releases the least recently used entries that no longer fit. Memory
+  // mapped archives are not cached, since their entries are already in memory.
+  void CacheEntry(int apos, const uchar * data, size_t size)
+  {
+    if(m_map != NULL || size == 0 || size > m_cache_max ||
+       m_cache.find(apos) != m_cache.end())
+      return;
+    while(m_cache_bytes + size > m_cache_max)
+    {
+      std::map<int, CachedEntry>::iterator it = m_cache.find(m_cache_lru.back());
+      m_cache_bytes -= it->second.buffer->Size();
+      delete it->second.buffer;
+      m_cache.erase(it);
+      m_cache_lru.pop_back();
+    }
+    CachedEntry cached;
+    cached.buffer = new SequenceBuffer();
+    if(!cached.buffer->Resize(size))
+    {
+      delete cached.buffer;
+      return;
+    }
+    memcpy(cached.buffer->Data(), data, size);
+    m_cache_lru.push_front(apos);
+    cached.lru = m_cache_lru.begin();
+    m_cache[apos] = cached;
+    m_cache_bytes += size;
+  }
+
+  // caches the data of the current libarchive entry (the entry is read, so
+  // the data does not need to be skipped)
+  void CacheEntry(int apos, struct archive_entry * entry)
+  {
+    SequenceBuffer buffer;
+    size_t size = (size_t)archive_entry_size(entry);
+    if(size > 0 && buffer.Resize(size) &&
+       archive_read_data(m_a, (void*)buffer.Data(), size) == (la_ssize_t)size)
+      CacheEntry(apos, buffer.Data(), size);
+    else
+      archive_read_data_skip(m_a);
+  }
+
+  void ClearCache()
+  {
+    std::map<int, CachedEntry>::iterator it;
+    for(it = m_cache.begin(); it != m_cache.end(); it++)
+      delete it->second.buffer;
+    m_cache.clear();
+    m_cache_lru.clear();
+    m_cache_bytes = 0;
+    m_cache_all = false;
+  }
+
+  // Reads the width and height of a PNG or JPEG image from its header
+  // (without decoding it). Returns false for other images and for JPEG
+  // images with Exif data, whose orientation the decoder may apply.
+  static bool ImageSize(const uchar * data, size_t size, CvSize * image_size)
+  {
+    // PNG: the IHDR chunk follows the 8-byte signature
+    if(size >= 24 && memcmp(data, "\x89PNG\r\n\x1a\n", 8) == 0 &&
+       memcmp(data + 12, "IHDR", 4) == 0)
+    {
+      *image_size = cvSize(BigEndian(data + 16, 4), BigEndian(data + 20, 4));
+      return image_size->width > 0 && image_size->height > 0;
+    }
+
+    // JPEG: find the start of frame (SOFn) segment
+    if(size < 4 || data[0] != 0xff || data[1] != 0xd8)
+      return false;
+    size_t i = 2;
+    while(i + 4 <= size && data[i] == 0xff)
+    {
+      uchar marker = data[i + 1];
+      if(marker == 0xff)  // fill byte
+      {
+        i++;
+        continue;
+      }
+      if(marker == 0x01 || (marker >= 0xd0 && marker <= 0xd7))
+      {
+        i += 2;  // markers without a segment
+        continue;
+      }
+      if(marker == 0xda || marker == 0xd9)  // start of scan, end of image
+        return false;
+      size_t length = (size_t)BigEndian(data + i + 2, 2);
+      if(marker == 0xe1 && i + 10 <= size && memcmp(data + i + 4, "Exif", 4) == 0)
+        return false;
+      if(marker >= 0xc0 && marker <= 0xcf &&
+         marker != 0xc4 && marker != 0xc8 && marker != 0xcc)
       {
-        printf("SequenceReaderArchive::Read: Header read error!\n");
-        printf("%s\n", archive_error_string(m_a));
+        if(i + 9 > size)
+          return false;
+        *image_size = cvSize(BigEndian(data + i + 7, 2),
+                             BigEndian(data + i + 5, 2));
+        return image_size->width > 0 && image_size->height > 0;
       }
+      i += 2 + length;
     }
+    return false;
+  }
 
-    return img;
+  static int BigEndian(const uchar * data, int n)
+  {
+    int value = 0;
+    for(int i = 0; i < n; i++)
+      value = (value << 8) | data[i];
+    return value;
+  }
+
+  // decode an image from an archive entry (this is thread safe)
+  IplImage * Decode(const uchar * data, size_t size)
+  {
+    if(data == NULL || size == 0)
+      return NULL;
+    CvMat bufm = cvMat((int)size, 1, CV_8U, (void*)data);
+    return cvDecodeImage(&bufm, m_is_color);
   }
 
   // returns the actual start index
@@ -302,7 +832,36 @@ private:
   std::map<std::string, int> m_name_map;
   std::map<int, int> m_index_map;
   std::vector<int64> m_indexes; // for seeking
+  std::vector<int64> m_data_offsets;  // offset of each entry's data
+  std::vector<int64> m_data_sizes;    // size of each entry's data
+  // decompressed data passed to libarchive while indexing compressed files
+  struct ChunkedSource
+  {
+    ChunkedReader * reader;
+    std::vector<uchar> buffer;
+  };
+  ChunkedReader * m_chunked;  // reader of files with several chunks
+  std::vector<ChunkedReader::Chunk> m_chunks;  // offsets of the chunks
+  const uchar * m_map;  // memory mapped archive (plain tar files only)
+  int64 m_map_size;
+#ifdef WIN32
+  HANDLE m_map_handle;
+#endif
   std::string m_pattern;
+  SequenceBuffer m_entry;  // the entry of the first frame, read by Open()
+  int m_entry_pos;         // the frame of m_entry (-1 if none)
+  // encoded entries of recently read frames, by archive position, so that
+  // reading them again does not decompress or seek in the archive
+  struct CachedEntry
+  {
+    SequenceBuffer * buffer;
+    std::list<int>::iterator lru;
+  };
+  std::map<int, CachedEntry> m_cache;
+  std::list<int> m_cache_lru;  // archive positions, most recently used first
+  size_t m_cache_bytes;
+  size_t m_cache_max;
+  bool m_cache_all;  // true if all entries fit in the cache
 };
 
 #endif // SEQUENCE_READER_ARCHIVE_H
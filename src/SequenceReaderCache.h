@@ -0,0 +1,345 @@
+//
+// File: SequenceReaderCache.h
+// Purpose: Wraps other readers and keeps recently read frames in memory, so
+//   that reading a frame again (e.g., when scrubbing through a sequence or
+//   sampling frames at random) does not decode it again.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#ifndef SEQUENCE_READER_CACHE_H
+#define SEQUENCE_READER_CACHE_H
+
+#include "SequenceReader.h"
+#include <stdlib.h>
+#include <list>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+//
+// Frames are kept in least-recently-used order and keyed by frame index and
+// is_color, so reopening the same sequence in another color mode does not
+// return frames of the wrong type (the cache is only cleared when a
+// different sequence is opened). The least recently used frames are released
+// once the frames take more than max_bytes. Frames in pinned ranges are
+// never released, but they count toward max_bytes: when only pinned frames
+// are left, new frames are returned without being cached.
+//
+class SequenceReaderCache : public SequenceReader
+{
+public:
+  struct Stats
+  {
+    size_t hits;       // frames returned from the cache
+    size_t misses;     // frames read from the wrapped reader
+    size_t evictions;  // frames released to stay within max_bytes
+    size_t frames;     // frames in the cache
+    size_t bytes;      // bytes in the cache
+  };
+
+  // if prefetch > 0, the wrapped reader prefetches frames (see
+  // CreatePrefetch())
+  SequenceReaderCache(size_t max_bytes, int prefetch = 0, int n_threads = 1)
+    : m_reader(NULL), m_max_bytes(max_bytes), m_prefetch(prefetch),
+    m_n_threads(n_threads), m_is_color(-1), m_next(-1)
+  {
+    Stats stats = { 0, 0, 0, 0, 0 };
+    m_stats = stats;
+  }
+
+  // the cache size in MB set by the SEQUENCES_FRAME_CACHE_MB environment
+  // variable (default: 256)
+  static size_t DefaultMaxBytes()
+  {
+    const char * env = getenv("SEQUENCES_FRAME_CACHE_MB");
+    int mb = env ? atoi(env) : 256;
+    return (size_t)MAX(mb, 0) << 20;
+  }
+
+  virtual bool Open(const char * filename, int first, int last, int is_color)
+  {
+    Close();
+    if(filename == NULL)
+      return false;
+    if(m_filename != filename)
+    {
+      Clear();
+      m_pinned.clear();
+      m_filename = filename;
+    }
+
+    m_reader = (m_prefetch > 0) ?
+      CreatePrefetch(filename, first, last, is_color, m_prefetch, m_n_threads) :
+      Create(filename, first, last, is_color);
+    if(m_reader == NULL)
+      return false;
+    m_is_color = is_color;
+    m_next = m_reader->Next();
+    return true;
+  }
+
+  // releases the wrapped reader, but keeps the cached frames in case the
+  // same sequence is opened again
+  virtual void Close()
+  {
+    Destroy(&m_reader);
+    m_next = -1;
+  }
+
+  // the returned image needs to be released by the caller!!
+  virtual IplImage * Read(int pos)
+  {
+    if(m_reader == NULL)
+      return NULL;
+
+    IplImage * image = Find(pos);
+    if(image != NULL)
+    {
+      m_next = pos + 1;
+      return cvCloneImage(image);
+    }
+
+    m_stats.misses++;
+    image = m_reader->Read(pos);
+    if(image == NULL)
+      return NULL;
+    m_next = m_reader->Next();
+    if(Reserve(image->imageSize))
+      Insert(pos, cvCloneImage(image));
+    return image;
+  }
+
+  virtual bool Read(int pos, IplImage * dst)
+  {
+    if(m_reader == NULL || dst == NULL)
+      return false;
+
+    IplImage * image = Find(pos);
+    if(image != NULL)
+    {
+      if(image->width != dst->width || image->height != dst->height ||
+         image->depth != dst->depth || image->nChannels != dst->nChannels)
+      {
+        printf("SequenceReaderCache::Read: the frame does not match the image.\n");
+        return false;
+      }
+      cvCopy(image, dst);
+      m_next = pos + 1;
+      return true;
+    }
+
+    m_stats.misses++;
+    if(!m_reader->Read(pos, dst))
+      return false;
+    m_next = m_reader->Next();
+    if(Reserve(dst->imageSize))
+      Insert(pos, cvCloneImage(dst));
+    return true;
+  }
+
+  // each run of consecutive frames that are not cached is read with a
+  // single call to the wrapped reader, which may decode them at the same time
+  virtual int ReadRange(int first, int last, int step, IplImage ** images)
+  {
+    if(m_reader == NULL || step <= 0)
+      return 0;
+
+    int n_read = 0, n = (last - first) / step + 1;
+    std::vector<bool> cached(MAX(n, 0), false);
+    for(int i = 0; i < n; i++)
+    {
+      IplImage * image = Find(first + i * step);
+      images[i] = image ? cvCloneImage(image) : NULL;
+      cached[i] = image != NULL;
+      if(image != NULL)
+        n_read++;
+    }
+
+    bool read = false;
+    for(int i_first = 0; i_first < n; )
+    {
+      if(cached[i_first])
+      {
+        i_first++;
+        continue;
+      }
+      int i_last = i_first;
+      while(i_last + 1 < n && !cached[i_last + 1])
+        i_last++;
+      m_reader->ReadRange(first + i_first * step, first + i_last * step, step,
+                          &images[i_first]);
+      read = true;
+      for(int i = i_first; i <= i_last; i++)
+      {
+        m_stats.misses++;
+        if(images[i] == NULL)
+          continue;
+        n_read++;
+        if(Reserve(images[i]->imageSize))
+          Insert(first + i * step, cvCloneImage(images[i]));
+      }
+      i_first = i_last + 1;
+    }
+    if(read)
+      m_next = m_reader->Next();
+    return n_read;
+  }
+
+  virtual int First()
+  {
+    if(m_reader)
+      return m_reader->First();
+    return -1;
+  }
+
+  virtual int Last()
+  {
+    if(m_reader)
+      return m_reader->Last();
+    return -1;
+  }
+
+  // after a frame is returned from the cache, the wrapped reader is not
+  // asked, so the next frame is assumed to be the one after it
+  virtual int Next()
+  {
+    return m_next;
+  }
+
+  virtual CvSize Size()
+  {
+    if(m_reader)
+      return m_reader->Size();
+    return cvSize(-1, -1);
+  }
+
+  virtual int Keyframe(int pos)
+  {
+    if(m_reader)
+      return m_reader->Keyframe(pos);
+    return pos;
+  }
+
+  // keeps the frames first..last (inclusive) in the cache once they are read
+  void Pin(int first, int last)
+  {
+    if(first <= last)
+      m_pinned.push_back(std::make_pair(first, last));
+  }
+
+  // removes all pinned ranges (their frames can be released again)
+  void Unpin()
+  {
+    m_pinned.clear();
+  }
+
+  // releases all cached frames
+  void Clear()
+  {
+    std::list<Entry>::iterator it;
+    for(it = m_lru.begin(); it != m_lru.end(); it++)
+      cvReleaseImage(&it->image);
+    m_lru.clear();
+    m_entries.clear();
+    m_stats.frames = 0;
+    m_stats.bytes = 0;
+  }
+
+  Stats GetStats()
+  {
+    return m_stats;
+  }
+
+  virtual ~SequenceReaderCache()
+  {
+    Close();
+    Clear();
+  }
+
+private:
+  typedef std::pair<int, int> Key;  // frame index, is_color
+
+  struct Entry
+  {
+    Key key;
+    IplImage * image;
+  };
+
+  bool IsPinned(int pos)
+  {
+    for(size_t i = 0; i < m_pinned.size(); i++)
+      if(pos >= m_pinned[i].first && pos <= m_pinned[i].second)
+        return true;
+    return false;
+  }
+
+  // returns the cached frame at pos and marks it as the most recently used
+  // one (NULL if it is not cached)
+  IplImage * Find(int pos)
+  {
+    std::map<Key, std::list<Entry>::iterator>::iterator it =
+      m_entries.find(Key(pos, m_is_color));
+    if(it == m_entries.end())
+      return NULL;
+    m_lru.splice(m_lru.begin(), m_lru, it->second);
+    m_stats.hits++;
+    return it->second->image;
+  }
+
+  // releases unpinned frames, least recently used first, until a frame of
+  // size bytes fits; returns false if it does not fit (or should not be
+  // cached)
+  bool Reserve(size_t size)
+  {
+    if(size > m_max_bytes)
+      return false;
+    std::list<Entry>::iterator it = m_lru.end();
+    while(m_stats.bytes + size > m_max_bytes && it != m_lru.begin())
+    {
+      it--;
+      if(IsPinned(it->key.first))
+        continue;
+      m_stats.bytes -= it->image->imageSize;
+      m_stats.frames--;
+      m_stats.evictions++;
+      cvReleaseImage(&it->image);
+      m_entries.erase(it->key);
+      it = m_lru.erase(it);
+    }
+    return m_stats.bytes + size <= m_max_bytes;
+  }
+
+  void Insert(int pos, IplImage * image)
+  {
+    Entry entry = { Key(pos, m_is_color), image };
+    m_lru.push_front(entry);
+    m_entries[entry.key] = m_lru.begin();
+    m_stats.bytes += image->imageSize;
+    m_stats.frames++;
+  }
+
+  SequenceReader * m_reader;
+  size_t m_max_bytes;
+  int m_prefetch;
+  int m_n_threads;
+  int m_is_color;
+  int m_next;  // frame after the last frame read
+  std::string m_filename;
+  std::list<Entry> m_lru;  // most recently used first
+  std::map<Key, std::list<Entry>::iterator> m_entries;
+  std::vector<std::pair<int, int> > m_pinned;
+  Stats m_stats;
+};
+
+#endif // SEQUENCE_READER_CACHE_H
@@ -20,16 +20,26 @@
 // limitations under the License.
 //
 #include "SequenceReader.h"
+#include "SequenceIndexCache.h"
+#include "SequenceBufferPool.h"
 #include "cv.h"
 #include "highgui.h"
 #include <stdio.h>
+#include <errno.h>
+#include <math.h>
+#include <vector>
+#include <map>
+#include <algorithm>
 
 #ifdef WIN32
+#include <io.h>
 #define popen _popen
 #define pclose _pclose
 #define PIPE_STDERR_TO_NULL "2> NUL"
 #define POPEN_READ_MODE "rb"  // windows needs the "b" character
 #else
+#include <fcntl.h>
+#include <unistd.h>
 #define PIPE_STDERR_TO_NULL "2> /dev/null"
 #define POPEN_READ_MODE "r"   // linux fails with the "b" character
 #endif
@@ -44,7 +54,11 @@ public:
     m_pos = 0;
     m_first = -1;
     m_last = -1;
+    m_requested_last = -1;
+    m_count = -1;
+    m_verified = false;
     m_image = NULL;
+    m_is_color = 1;
     m_filename = NULL;
   }
 
@@ -52,27 +66,64 @@ public:
   virtual bool Open(const char * filename, int first, int last, int is_color)
   {
     m_filename = strdup(filename);
+    m_is_color = is_color;
 
-    // determine frame size and video length
-    if(!SetSize())
-      return false;
-    if(!Open())
-      return false;
-    SetLast();
+    // use the cached frame size, video length, and keyframes if the video
+    // has not changed since it was last indexed
+    SequenceIndexCache cache(m_filename, "ffmpeg");
+    if(cache.Load() && cache.m_size.width > 0 && cache.m_last >= 0)
+    {
+      m_size = cache.m_size;
+      m_count = cache.m_last + 1;
+      m_keyframes = cache.m_keyframes;
+      m_image = CreateImage();
+      if(!Open())
+        return false;
+    }
+    else
+    {
+      // determine the frame size, and count the frames from the packet index
+      // (the video is decoded to count frames only if the packets do not map
+      // exactly to decoded frames)
+      if(!SetSize())
+        return false;
+      if(!Open())
+        return false;
+      if(!CreateIndex())
+        CountFrames();
+      SaveIndex();
+    }
 
     m_first = MAX(first, 0);
-    if(last > 0)      
-      m_last = MIN(last, m_last);
+    m_requested_last = last;
+    SetLast(m_count);
 
     return true;
   }
 
-  // Extract a frame using ffmpeg and get its size
+  // save the frame size, video length, and keyframes to the index cache
+  void SaveIndex()
+  {
+    SequenceIndexCache cache(m_filename, "ffmpeg");
+    cache.m_size = m_size;
+    cache.m_last = m_count - 1;
+    cache.m_keyframes = m_keyframes;
+    cache.Save();
+  }
+
+  // Get the frame size from the stream headers with ffprobe, or, if that
+  // fails, by extracting a frame with ffmpeg
   bool SetSize()
   {
+    if(ProbeSize())
+    {
+      m_image = CreateImage();
+      return m_image != NULL;
+    }
+
     char cmd[4096];
-    sprintf(cmd, "ffmpeg -i \"%s\" -f image2pipe -vcodec ppm -vframes 1 - "
-          PIPE_STDERR_TO_NULL, m_filename);
+    sprintf(cmd, "ffmpeg -i \"%s\" -map 0:v:0 -f image2pipe -vcodec ppm "
+          "-vframes 1 - " PIPE_STDERR_TO_NULL, m_filename);
     FILE * fp = popen(cmd, POPEN_READ_MODE);
     if(fp)
     {
@@ -82,13 +133,18 @@ public:
       std::vector<char> data;
       while(readsize = fread(buffer, 1, buffsize, fp))
         data.insert(data.end(), buffer, buffer + readsize);
+      IplImage * image = NULL;
       if(!data.empty())
       {
         CvMat bufm = cvMat((int)data.size(), 1, CV_8U, (void*)&data[0]);
-        m_image = cvDecodeImage(&bufm, 1);
+        image = cvDecodeImage(&bufm, 1);
+      }
+      if(image)
+      {
+        m_size = cvGetSize(image);
+        cvReleaseImage(&image);
+        m_image = CreateImage();
       }
-      if(m_image)
-        m_size = cvGetSize(m_image);
       pclose(fp);
       return m_image != NULL;
     }
@@ -97,35 +153,280 @@ public:
     return false;
   }
 
-  // Step forward through the video until the end is reached to get the video length
-  void SetLast()
+  // Read the frame size of the video stream with ffprobe, which only parses
+  // the stream headers (nothing is decoded). ffmpeg is run with -map 0:v:0,
+  // so that it decodes the same stream (instead of the one with the highest
+  // resolution, e.g., cover art). ffmpeg rotates the frames of
+  // videos with a rotation tag or display matrix (e.g., from phones), so
+  // the width and height are swapped for 90 and 270 degree rotations.
+  bool ProbeSize()
+  {
+    char cmd[4096];
+    sprintf(cmd, "ffprobe -v error -select_streams v:0 -show_entries "
+      "stream=width,height:stream_tags=rotate:stream_side_data=rotation "
+      "-of default=noprint_wrappers=1 \"%s\" " PIPE_STDERR_TO_NULL,
+      m_filename);
+    FILE * fp = popen(cmd, POPEN_READ_MODE);
+    if(fp == NULL)
+      return false;
+
+    int width = 0, height = 0, rotation = 0;
+    char line[1024];
+    while(fgets(line, sizeof(line), fp))
+    {
+      double degrees;
+      if(sscanf(line, "width=%i", &width) == 1 ||
+         sscanf(line, "height=%i", &height) == 1)
+        continue;
+      if(sscanf(line, "TAG:rotate=%lf", &degrees) == 1 ||
+         sscanf(line, "rotation=%lf", &degrees) == 1)
+        rotation = (int)floor(degrees + 0.5);
+    }
+    pclose(fp);
+    if(width <= 0 || height <= 0)
+      return false;
+
+    if(abs(rotation) % 180 == 90)
+      std::swap(width, height);
+    m_size = cvSize(width, height);
+    return true;
+  }
+
+  // Step forward through the video until the end is reached to get the video
+  // length, and set the frame count (see SetLast())
+  void CountFrames()
   {
     while(ReadNext());
-    m_last = m_pos - 1;
+    m_verified = true;
+    SetLast(m_pos);
   }
 
-  bool Open()
+  // set the frame count of the video and the last frame of the sequence
+  void SetLast(int count)
+  {
+    m_count = count;
+    m_last = m_count - 1;
+    if(m_requested_last > 0)
+      m_last = MIN(m_requested_last, m_last);
+  }
+
+  // The frame count from the packet index is verified when the end of the
+  // stream is reached. If it does not match the number of decoded frames,
+  // the frame count is corrected and the keyframe index is discarded (since
+  // the packets did not map exactly to decoded frames).
+  // Assumes:
+  //   m_pos frames were read, and either the stream ended or m_pos == m_count
+  void VerifyLast(bool ended)
+  {
+    if(m_verified)
+      return;
+    m_verified = true;
+    if(!ended)
+    {
+      // the indexed frame count was read--check that this is the end
+      int count = m_pos;
+      while(ReadNext());
+      if(m_pos == count)
+        return;
+    }
+    printf("SequenceReaderFfmpeg: '%s' has %i frames, but %i were indexed.\n",
+      m_filename, m_pos, m_count);
+    m_keyframes.clear();
+    SetLast(m_pos);
+    SaveIndex();
+  }
+
+  // Build an index of the keyframes of the video with ffprobe, which only
+  // reads packet headers (nothing is decoded), and set the frame count to
+  // the number of packets. Seek() uses the index to restart ffmpeg at the
+  // closest keyframe preceding the requested frame instead of at frame 0.
+  // Returns false and leaves the index empty (i.e., seeking backwards starts
+  // from the beginning) unless the packet timestamps map exactly to the
+  // frame indexes produced by ffmpeg.
+  bool CreateIndex()
+  {
+    m_keyframes.clear();
+
+    char cmd[4096];
+    sprintf(cmd, "ffprobe -v error -select_streams v:0 -show_entries "
+      "packet=pts_time,flags:format=start_time -of csv \"%s\" "
+      PIPE_STDERR_TO_NULL, m_filename);
+    FILE * fp = popen(cmd, POPEN_READ_MODE);
+    if(fp == NULL)
+      return false;
+
+    // read the presentation time and keyframe flag of each packet (packets
+    // flagged as discarded, e.g., by an edit list, are not output as frames)
+    std::vector< std::pair<double, bool> > packets;
+    double start_time = 0;
+    bool valid = true;
+    char line[1024];
+    while(fgets(line, sizeof(line), fp))
+    {
+      double t;
+      char flags[16];
+      if(strncmp(line, "packet,", 7) == 0)
+      {
+        if(sscanf(line + 7, "%lf,%15s", &t, flags) == 2)
+        {
+          if(flags[1] != 'D')
+            packets.push_back(std::make_pair(t, flags[0] == 'K'));
+        }
+        else
+          valid = false;  // the timestamp is missing (N/A)
+      }
+      else if(strncmp(line, "format,", 7) == 0)
+        sscanf(line + 7, "%lf", &start_time);
+    }
+    pclose(fp);
+
+    // ffmpeg outputs frames in presentation order
+    std::sort(packets.begin(), packets.end());
+    if(!valid || packets.size() < 2)
+      return false;
+
+    // only constant frame rate videos map frame indexes to timestamps
+    // exactly (ffmpeg drops or duplicates frames of variable frame rate
+    // videos when writing rawvideo)
+    std::vector<double> deltas;
+    for(size_t i = 1; i < packets.size(); i++)
+      deltas.push_back(packets[i].first - packets[i - 1].first);
+    std::vector<double> sorted(deltas);
+    std::nth_element(sorted.begin(), sorted.begin() + sorted.size() / 2,
+      sorted.end());
+    double delta = sorted[sorted.size() / 2];
+    for(size_t i = 0; i < deltas.size(); i++)
+      if(deltas[i] <= 0 || fabs(deltas[i] - delta) > 0.25 * delta)
+        return false;
+
+    // seek halfway between the keyframe and the frame before it, so that
+    // the rounding of the printed timestamps cannot skip the keyframe
+    // (ffmpeg's -ss is relative to the start time of the file)
+    for(size_t i = 1; i < packets.size(); i++)
+      if(packets[i].second)
+        m_keyframes[(int)i] =
+          0.5 * (packets[i - 1].first + packets[i].first) - start_time;
+    m_count = (int)packets.size();
+    return true;
+  }
+
+  // returns the index of the closest keyframe at or before pos (0 if unknown)
+  virtual int Keyframe(int pos)
+  {
+    std::map<int, double>::iterator it = m_keyframes.upper_bound(pos);
+    if(it == m_keyframes.begin())
+      return 0;
+    return (--it)->first;
+  }
+
+  // Returns the pixel format that ffmpeg outputs, as requested by is_color
+  // (the flags of cvLoadImage: 0 is gray, CV_LOAD_IMAGE_ANYDEPTH keeps 16
+  // bits per channel, and SequenceReader::YUV420P outputs planar YUV). The
+  // chroma planes of frames with an odd width or height are rounded up and
+  // do not fit in 3/2 of the rows, so those frames are output as bgr24.
+  const char * PixelFormat()
+  {
+    if(m_is_color == SequenceReader::YUV420P)
+      return m_size.width % 2 == 0 && m_size.height % 2 == 0 ?
+        "yuv420p" : "bgr24";
+    if(m_is_color == 0)
+      return "gray";
+    if(m_is_color == CV_LOAD_IMAGE_ANYDEPTH)
+      return "gray16le";
+    if(m_is_color == (CV_LOAD_IMAGE_ANYDEPTH | CV_LOAD_IMAGE_COLOR))
+      return "bgr48le";
+    return "bgr24";
+  }
+
+  // creates an image in the format of the frames output by ffmpeg (yuv420p
+  // frames are single-channel images with the Y plane in the first m_size
+  // rows, followed by the U and V planes)
+  IplImage * CreateImage()
+  {
+    const char * format = PixelFormat();
+    if(strcmp(format, "yuv420p") == 0)
+      return cvCreateImage(cvSize(m_size.width, m_size.height * 3 / 2), 8, 1);
+    int depth = strstr(format, "16") || strstr(format, "48") ? 16 : 8;
+    int channels = strncmp(format, "gray", 4) == 0 ? 1 : 3;
+    return cvCreateImage(m_size, depth, channels);
+  }
+
+  // (re)start ffmpeg at frame 'start', which must be 0 or a keyframe
+  bool Open(int start = 0)
   {
     m_pos = 0;
     if(m_fp)
       pclose(m_fp);
+    char seek[64] = "";
+    if(start > 0 && m_keyframes.find(start) != m_keyframes.end())
+    {
+      sprintf(seek, "-ss %.6f ", m_keyframes[start]);
+      m_pos = start;
+    }
     char cmd[4096];
-    sprintf(cmd, "ffmpeg -i \"%s\" -f rawvideo -pix_fmt bgr24 - "
-      PIPE_STDERR_TO_NULL, m_filename);
+    sprintf(cmd, "ffmpeg %s-i \"%s\" -map 0:v:0 -f rawvideo -pix_fmt %s - "
+      PIPE_STDERR_TO_NULL, seek, m_filename, PixelFormat());
     m_fp = popen(cmd, POPEN_READ_MODE);
+#ifdef F_SETPIPE_SZ
+    // let ffmpeg write a whole frame (up to the system limit) before it
+    // waits for the reader
+    if(m_fp && m_image)
+      fcntl(fileno(m_fp), F_SETPIPE_SZ, MIN(m_image->imageSize, 1 << 20));
+#endif
     return m_fp != NULL;
   }
 
-  bool ReadNext()
+  // Reads the next frame into image (or skips it, if image is NULL). Frames
+  // are read from the pipe's file descriptor with as few read() calls as
+  // possible (the FILE buffer is not used), directly into the image if its
+  // rows are not padded, or into a buffer that is copied into the image.
+  bool ReadNext(IplImage * image = NULL)
   {
-    for(int i = 0; i < m_image->height; i++)
-      if(fread(&CV_IMAGE_ELEM(m_image, uchar, i, 0),
-        m_image->width*m_image->nChannels, 1, m_fp) != 1)
-        return false;
+    int row_size = m_image->width * m_image->nChannels *
+      (m_image->depth & 255) / 8;
+    size_t size = (size_t)row_size * m_image->height;
+    bool packed = image && image->widthStep == row_size;
+    if(!packed && !m_buffer.Resize(size))
+      return false;
+    uchar * data = packed ? (uchar*)image->imageData : m_buffer.Data();
+    if(m_fp == NULL || !ReadFull(fileno(m_fp), data, size))
+    {
+      // the stream ended before the indexed frame count
+      if(m_pos < m_count)
+        VerifyLast(true);
+      return false;
+    }
+    if(image && !packed)
+    {
+      CvMat packed_mat = cvMat(m_image->height, m_image->width,
+        CV_MAKETYPE(image->depth == IPL_DEPTH_16U ? CV_16U : CV_8U,
+                    image->nChannels), data);
+      cvCopy(&packed_mat, image);
+    }
     m_pos++;
     return true;
   }
 
+  // reads size bytes from a file descriptor (fails at the end of the file)
+  static bool ReadFull(int fd, uchar * data, size_t size)
+  {
+    while(size > 0)
+    {
+#ifdef WIN32
+      int n = _read(fd, data, (unsigned int)MIN(size, (size_t)1 << 30));
+#else
+      int n = (int)read(fd, data, MIN(size, (size_t)1 << 30));
+#endif
+      if(n < 0 && errno == EINTR)
+        continue;
+      if(n <= 0)
+        return false;
+      data += n;
+      size -= (size_t)n;
+    }
+    return true;
+  }
+
   // closes the sequence
   virtual void Close()
   {
@@ -142,14 +443,40 @@ public:
     }
 
     cvReleaseImage(&m_image);
+    m_keyframes.clear();
+    m_count = -1;
+    m_verified = false;
   }
 
   // the returned image needs to be released by the caller!!
   virtual IplImage * Read(int pos)
   {
-    if(Seek(pos) && ReadNext())
-      return cvCloneImage(m_image);
-    return NULL;
+    if(m_image == NULL)
+      return NULL;
+    IplImage * image = cvCreateImage(cvGetSize(m_image), m_image->depth,
+                                     m_image->nChannels);
+    if(!Read(pos, image))
+      cvReleaseImage(&image);
+    return image;
+  }
+
+  // reads the decoded frame from ffmpeg directly into dst
+  virtual bool Read(int pos, IplImage * dst)
+  {
+    if(m_image == NULL || dst == NULL ||
+       dst->width != m_image->width || dst->height != m_image->height ||
+       dst->depth != m_image->depth || dst->nChannels != m_image->nChannels)
+    {
+      printf("SequenceReaderFfmpeg::Read: the frame does not match the image.\n");
+      return false;
+    }
+    if(Seek(pos) && ReadNext(dst))
+    {
+      if(m_pos == m_count)
+        VerifyLast(false);
+      return true;
+    }
+    return false;
   }
   
   // returns the actual start index
@@ -183,12 +510,11 @@ public:
 
   bool Seek(int pos)
   {
-    // for non-seekable files, start from the beginning to seek backwards
-    if(pos < m_pos)
-    {
-      m_pos = 0;
-      Open();
-    }
+    // restart from the closest keyframe (or from the beginning if there is no
+    // keyframe index) to seek backwards or to skip past the next keyframe
+    int start = Keyframe(pos);
+    if(pos < m_pos || start > m_pos)
+      Open(start);
 
     // seek forward to current position, if necessary
     while(pos > m_pos && ReadNext());
@@ -206,9 +532,15 @@ private:
   FILE * m_fp;
   int m_first;
   int m_last;
+  int m_requested_last;  // last frame requested by Open() (-1 if none)
+  int m_count;           // number of frames in the video
+  bool m_verified;       // true if m_count was checked by decoding
   int m_pos;
   CvSize m_size;
-  IplImage * m_image;
+  IplImage * m_image;    // describes the format of the decoded frames
+  int m_is_color;        // requested format (see PixelFormat())
+  SequenceBuffer m_buffer;  // frame read from ffmpeg (if not read directly)
   char * m_filename;
+  std::map<int, double> m_keyframes; // keyframe index -> ffmpeg seek time
 };
 
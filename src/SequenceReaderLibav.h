@@ -0,0 +1,603 @@
+//
+// File: SequenceReaderLibav.h
+// Purpose: Implements the SequenceReader interface to read videos in-process
+//   with libavformat/libavcodec (instead of piping frames from an ffmpeg
+//   process, as SequenceReaderFfmpeg does).
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#ifndef SEQUENCE_READER_LIBAV_H
+#define SEQUENCE_READER_LIBAV_H
+
+#include "SequenceReader.h"
+#include "SequenceIndexCache.h"
+#include "SequenceBufferPool.h"
+#include "SequenceThreadPool.h"
+#include "cv.h"
+#include "highgui.h"
+#include <stdio.h>
+#include <math.h>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <mutex>
+
+extern "C" {
+#include "libavformat/avformat.h"
+#include "libavcodec/avcodec.h"
+#include "libswscale/swscale.h"
+#include "libavutil/imgutils.h"
+#include "libavutil/display.h"
+}
+
+//
+// Frames are numbered in presentation order, as ffmpeg outputs them. When the
+// video is opened, its packets are read (without decoding them) to count the
+// frames and to index the timestamps of the keyframes, so that seeking
+// backwards or far ahead restarts decoding at the closest keyframe preceding
+// the requested frame. Videos that ffmpeg would rotate (i.e., with a rotation
+// tag or display matrix) and variable frame rate videos (whose frames ffmpeg
+// drops or duplicates) are not opened, so that the ffmpeg reader reads them
+// instead and frames have the same indexes with either reader.
+//
+class SequenceReaderLibav : public SequenceReader
+{
+public:
+  SequenceReaderLibav()
+  {
+    m_format = NULL;
+    m_codec = NULL;
+    m_packet = NULL;
+    m_frame = NULL;
+    m_sws = NULL;
+    m_stream = -1;
+    m_pos = 0;
+    m_first = -1;
+    m_last = -1;
+    m_requested_last = -1;
+    m_count = -1;
+    m_verified = false;
+    m_variable_rate = false;
+    m_skip_pts = AV_NOPTS_VALUE;
+    m_image = NULL;
+    m_is_color = 1;
+    m_filename = NULL;
+  }
+
+  // open a sequence
+  virtual bool Open(const char * filename, int first, int last, int is_color)
+  {
+    m_filename = strdup(filename);
+    m_is_color = is_color;
+    if(!OpenInput())
+      return false;
+
+    // use the cached video length and keyframes if the video has not changed
+    // since it was last indexed
+    SequenceIndexCache cache(m_filename, "libav");
+    if(cache.Load() && cache.m_size.width > 0 && cache.m_last >= 0)
+    {
+      m_count = cache.m_last + 1;
+      m_keyframes = cache.m_keyframes;
+    }
+    else
+    {
+      // count the frames from the packets (the video is decoded from the
+      // beginning to count frames only if the packets do not have
+      // timestamps, since CreateIndex() read all packets)
+      if(!CreateIndex())
+      {
+        if(m_variable_rate || !Restart(0))
+          return false;
+        CountFrames();
+      }
+      SaveIndex();
+      if(!Restart(0))
+        return false;
+    }
+    if(m_count <= 0)
+      return false;
+
+    m_image = CreateImage();
+    m_first = MAX(first, 0);
+    m_requested_last = last;
+    SetLast(m_count);
+
+    return true;
+  }
+
+  // save the frame size, video length, and keyframes to the index cache
+  void SaveIndex()
+  {
+    SequenceIndexCache cache(m_filename, "libav");
+    cache.m_size = m_size;
+    cache.m_last = m_count - 1;
+    cache.m_keyframes = m_keyframes;
+    cache.Save();
+  }
+
+  // opens the file and the decoder of its video stream, and sets the frame
+  // size
+  bool OpenInput()
+  {
+#if LIBAVFORMAT_VERSION_INT < AV_VERSION_INT(58, 9, 100)
+    av_register_all();
+#endif
+    QuietLog();
+    m_pos = 0;
+    m_skip_pts = AV_NOPTS_VALUE;
+    if(avformat_open_input(&m_format, m_filename, NULL, NULL) < 0 ||
+       avformat_find_stream_info(m_format, NULL) < 0)
+      return false;
+
+#if LIBAVFORMAT_VERSION_MAJOR < 59
+    AVCodec * decoder = NULL;
+#else
+    const AVCodec * decoder = NULL;
+#endif
+    // the first video stream, as the ffmpeg reader decodes (-map 0:v:0)
+    int first_video = -1;
+    for(unsigned int i = 0; i < m_format->nb_streams && first_video < 0; i++)
+      if(m_format->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
+        first_video = (int)i;
+    m_stream = av_find_best_stream(m_format, AVMEDIA_TYPE_VIDEO, first_video,
+                                   -1, &decoder, 0);
+    if(m_stream < 0 || decoder == NULL)
+      return false;
+    AVStream * stream = m_format->streams[m_stream];
+    if(Rotated(stream))
+      return false;
+
+    // decode with one thread per core (or SEQUENCES_THREADS threads), each
+    // decoding a different frame or slice
+    m_codec = avcodec_alloc_context3(decoder);
+    if(m_codec == NULL ||
+       avcodec_parameters_to_context(m_codec, stream->codecpar) < 0)
+      return false;
+    m_codec->thread_count = SequenceThreadPool::DefaultThreads();
+    m_codec->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+    if(avcodec_open2(m_codec, decoder, NULL) < 0)
+      return false;
+
+    m_size = cvSize(stream->codecpar->width, stream->codecpar->height);
+    m_packet = av_packet_alloc();
+    m_frame = av_frame_alloc();
+    return m_packet && m_frame && m_size.width > 0 && m_size.height > 0;
+  }
+
+  // libav messages are not printed, as ffmpeg's stderr is discarded by the
+  // ffmpeg reader. The log level is set once, and only if the application
+  // has not set it (or if the SEQUENCES_LIBAV_LOG environment variable is
+  // set), since it applies to the whole process.
+  static void QuietLog()
+  {
+    static std::once_flag once;
+    std::call_once(once, []() {
+      if(av_log_get_level() == AV_LOG_INFO && !getenv("SEQUENCES_LIBAV_LOG"))
+        av_log_set_level(AV_LOG_QUIET);
+    });
+  }
+
+  void CloseInput()
+  {
+    av_frame_free(&m_frame);
+    av_packet_free(&m_packet);
+    avcodec_free_context(&m_codec);
+    avformat_close_input(&m_format);
+    m_stream = -1;
+  }
+
+  // returns true if ffmpeg would rotate the frames of the stream
+  static bool Rotated(AVStream * stream)
+  {
+    const int32_t * matrix = NULL;
+#if LIBAVFORMAT_VERSION_MAJOR >= 61
+    const AVPacketSideData * side_data = av_packet_side_data_get(
+      stream->codecpar->coded_side_data, stream->codecpar->nb_coded_side_data,
+      AV_PKT_DATA_DISPLAYMATRIX);
+    if(side_data)
+      matrix = (const int32_t*)side_data->data;
+#else
+    matrix = (const int32_t*)av_stream_get_side_data(
+      stream, AV_PKT_DATA_DISPLAYMATRIX, NULL);
+#endif
+    if(matrix && fabs(av_display_rotation_get(matrix)) > 0.5)
+      return true;
+    AVDictionaryEntry * rotate = av_dict_get(stream->metadata, "rotate", NULL, 0);
+    return rotate && atoi(rotate->value) != 0;
+  }
+
+  // Step forward through the video until the end is reached to get the video
+  // length, and set the frame count (see SetLast())
+  void CountFrames()
+  {
+    while(ReadNext());
+    m_verified = true;
+    SetLast(m_pos);
+  }
+
+  // set the frame count of the video and the last frame of the sequence
+  void SetLast(int count)
+  {
+    m_count = count;
+    m_last = m_count - 1;
+    if(m_requested_last > 0)
+      m_last = MIN(m_requested_last, m_last);
+  }
+
+  // The frame count from the packets is verified when the end of the stream
+  // is reached. If it does not match the number of decoded frames, the frame
+  // count is corrected and the keyframe index is discarded.
+  // Assumes:
+  //   m_pos frames were read, and either the stream ended or m_pos == m_count
+  void VerifyLast(bool ended)
+  {
+    if(m_verified)
+      return;
+    m_verified = true;
+    if(!ended)
+    {
+      // the indexed frame count was read--check that this is the end
+      int count = m_pos;
+      while(ReadNext());
+      if(m_pos == count)
+        return;
+    }
+    printf("SequenceReaderLibav: '%s' has %i frames, but %i were indexed.\n",
+      m_filename, m_pos, m_count);
+    m_keyframes.clear();
+    SetLast(m_pos);
+    SaveIndex();
+  }
+
+  // Reads the packets of the video stream (without decoding them), and sets
+  // the frame count to the number of packets and the keyframe index to the
+  // timestamps of the keyframes, in presentation order. Returns false and
+  // leaves the index empty unless all packets have timestamps, or if the
+  // video has a variable frame rate (m_variable_rate is set; the same check
+  // as in SequenceReaderFfmpeg).
+  bool CreateIndex()
+  {
+    m_keyframes.clear();
+    m_variable_rate = false;
+
+    std::vector< std::pair<int64_t, bool> > packets;
+    bool valid = true;
+    while(av_read_frame(m_format, m_packet) >= 0)
+    {
+      // packets discarded by the demuxer (e.g., by an edit list) are not
+      // decoded into frames
+      if(m_packet->stream_index == m_stream &&
+         !(m_packet->flags & AV_PKT_FLAG_DISCARD))
+      {
+        if(m_packet->pts == AV_NOPTS_VALUE)
+          valid = false;
+        packets.push_back(std::make_pair(m_packet->pts,
+          (m_packet->flags & AV_PKT_FLAG_KEY) != 0));
+      }
+      av_packet_unref(m_packet);
+    }
+
+    std::sort(packets.begin(), packets.end());
+    if(!valid || packets.empty())
+      return false;
+
+    std::vector<double> deltas;
+    for(size_t i = 1; i < packets.size(); i++)
+      deltas.push_back((double)(packets[i].first - packets[i - 1].first));
+    if(!deltas.empty())
+    {
+      std::vector<double> sorted(deltas);
+      std::nth_element(sorted.begin(), sorted.begin() + sorted.size() / 2,
+        sorted.end());
+      double delta = sorted[sorted.size() / 2];
+      for(size_t i = 0; i < deltas.size(); i++)
+        if(deltas[i] <= 0 || fabs(deltas[i] - delta) > 0.25 * delta)
+          m_variable_rate = true;
+      if(m_variable_rate)
+        return false;
+    }
+
+    for(size_t i = 1; i < packets.size(); i++)
+      if(packets[i].second)
+        m_keyframes[(int)i] = (double)packets[i].first;
+    m_count = (int)packets.size();
+    return true;
+  }
+
+  // returns the index of the closest keyframe at or before pos (0 if unknown)
+  virtual int Keyframe(int pos)
+  {
+    std::map<int, double>::iterator it = m_keyframes.upper_bound(pos);
+    if(it == m_keyframes.begin())
+      return 0;
+    return (--it)->first;
+  }
+
+  // Returns the pixel format of the frames, as requested by is_color (the
+  // same formats as the ffmpeg reader outputs, including bgr24 instead of
+  // yuv420p for frames with an odd width or height).
+  AVPixelFormat PixelFormat()
+  {
+    if(m_is_color == SequenceReader::YUV420P)
+      return m_size.width % 2 == 0 && m_size.height % 2 == 0 ?
+        AV_PIX_FMT_YUV420P : AV_PIX_FMT_BGR24;
+    if(m_is_color == 0)
+      return AV_PIX_FMT_GRAY8;
+    if(m_is_color == CV_LOAD_IMAGE_ANYDEPTH)
+      return AV_PIX_FMT_GRAY16LE;
+    if(m_is_color == (CV_LOAD_IMAGE_ANYDEPTH | CV_LOAD_IMAGE_COLOR))
+      return AV_PIX_FMT_BGR48LE;
+    return AV_PIX_FMT_BGR24;
+  }
+
+  // creates an image in the format of the frames (yuv420p frames are
+  // single-channel images with the Y plane in the first m_size rows,
+  // followed by the U and V planes)
+  IplImage * CreateImage()
+  {
+    switch(PixelFormat())
+    {
+    case AV_PIX_FMT_YUV420P:
+      return cvCreateImage(cvSize(m_size.width, m_size.height * 3 / 2), 8, 1);
+    case AV_PIX_FMT_GRAY8:
+      return cvCreateImage(m_size, 8, 1);
+    case AV_PIX_FMT_GRAY16LE:
+      return cvCreateImage(m_size, 16, 1);
+    case AV_PIX_FMT_BGR48LE:
+      return cvCreateImage(m_size, 16, 3);
+    default:
+      return cvCreateImage(m_size, 8, 3);
+    }
+  }
+
+  // restart decoding at frame 'start', which must be 0 or a keyframe
+  bool Restart(int start)
+  {
+    std::map<int, double>::iterator it = m_keyframes.find(start);
+    if(start > 0 && it != m_keyframes.end() &&
+       av_seek_frame(m_format, m_stream, (int64_t)it->second,
+                     AVSEEK_FLAG_BACKWARD) >= 0)
+    {
+      // frames that precede the keyframe (e.g., the leading frames of an
+      // open GOP) are decoded but not counted
+      avcodec_flush_buffers(m_codec);
+      m_pos = start;
+      m_skip_pts = (int64_t)it->second;
+      return true;
+    }
+
+    // reopen the file to start from the beginning (not all formats can seek
+    // back to the first frame)
+    CloseInput();
+    return OpenInput();
+  }
+
+  // decodes the next frame into m_frame
+  bool Decode()
+  {
+    if(m_codec == NULL)
+      return false;
+    while(true)
+    {
+      int r = avcodec_receive_frame(m_codec, m_frame);
+      if(r == 0)
+      {
+        int64_t pts = m_frame->best_effort_timestamp;
+        if(m_skip_pts != AV_NOPTS_VALUE && pts != AV_NOPTS_VALUE &&
+           pts < m_skip_pts)
+        {
+          av_frame_unref(m_frame);
+          continue;
+        }
+        m_skip_pts = AV_NOPTS_VALUE;
+        return true;
+      }
+      if(r != AVERROR(EAGAIN))
+        return false;  // the decoder was drained (or failed)
+
+      if(av_read_frame(m_format, m_packet) < 0)
+      {
+        avcodec_send_packet(m_codec, NULL);  // drain the decoder
+        continue;
+      }
+      // corrupt packets are skipped, as ffmpeg does, but other errors (e.g.,
+      // out of memory) stop decoding
+      int sent = 0;
+      if(m_packet->stream_index == m_stream)
+        sent = avcodec_send_packet(m_codec, m_packet);
+      av_packet_unref(m_packet);
+      if(sent < 0 && sent != AVERROR_INVALIDDATA)
+        return false;
+    }
+  }
+
+  // Converts the decoded frame into image with libswscale. The frame is
+  // written directly into the image, except for yuv420p frames whose planes
+  // do not fit the image rows, which are copied from a buffer.
+  bool Convert(IplImage * image)
+  {
+    AVPixelFormat format = PixelFormat();
+    m_sws = sws_getCachedContext(m_sws, m_frame->width, m_frame->height,
+      (AVPixelFormat)m_frame->format, m_size.width, m_size.height, format,
+      SWS_BICUBIC, NULL, NULL, NULL);
+    if(m_sws == NULL)
+      return false;
+
+    uint8_t * planes[4] = { (uint8_t*)image->imageData, NULL, NULL, NULL };
+    int linesizes[4] = { image->widthStep, 0, 0, 0 };
+    bool packed = true;
+    if(format == AV_PIX_FMT_YUV420P)
+    {
+      // the U and V planes follow the Y plane, as in ffmpeg's rawvideo output
+      int size = av_image_get_buffer_size(format, m_size.width,
+                                          m_size.height, 1);
+      packed = image->widthStep == image->width &&
+        size <= image->width * image->height;
+      if(!packed && !m_buffer.Resize(size))
+        return false;
+      av_image_fill_arrays(planes, linesizes,
+        packed ? (uint8_t*)image->imageData : m_buffer.Data(), format,
+        m_size.width, m_size.height, 1);
+    }
+    sws_scale(m_sws, (const uint8_t * const *)m_frame->data, m_frame->linesize,
+              0, m_frame->height, planes, linesizes);
+    if(!packed)
+    {
+      CvMat packed_mat = cvMat(image->height, image->width, CV_8U,
+                               m_buffer.Data());
+      cvCopy(&packed_mat, image);
+    }
+    return true;
+  }
+
+  // Decodes the next frame into image (or skips it, if image is NULL, in
+  // which case the frame is decoded but not converted).
+  bool ReadNext(IplImage * image = NULL)
+  {
+    if(!Decode())
+    {
+      // the stream ended before the indexed frame count
+      if(m_pos < m_count)
+        VerifyLast(true);
+      return false;
+    }
+    bool success = image == NULL || Convert(image);
+    av_frame_unref(m_frame);
+    m_pos++;
+    return success;
+  }
+
+  // closes the sequence
+  virtual void Close()
+  {
+    CloseInput();
+    sws_freeContext(m_sws);
+    m_sws = NULL;
+
+    if(m_filename)
+    {
+      free((void*)m_filename);
+      m_filename = NULL;
+    }
+
+    cvReleaseImage(&m_image);
+    m_keyframes.clear();
+    m_count = -1;
+    m_verified = false;
+  }
+
+  // the returned image needs to be released by the caller!!
+  virtual IplImage * Read(int pos)
+  {
+    if(m_image == NULL)
+      return NULL;
+    IplImage * image = cvCreateImage(cvGetSize(m_image), m_image->depth,
+                                     m_image->nChannels);
+    if(!Read(pos, image))
+      cvReleaseImage(&image);
+    return image;
+  }
+
+  // decodes the frame directly into dst
+  virtual bool Read(int pos, IplImage * dst)
+  {
+    if(m_image == NULL || dst == NULL ||
+       dst->width != m_image->width || dst->height != m_image->height ||
+       dst->depth != m_image->depth || dst->nChannels != m_image->nChannels)
+    {
+      printf("SequenceReaderLibav::Read: the frame does not match the image.\n");
+      return false;
+    }
+    if(Seek(pos) && ReadNext(dst))
+    {
+      if(m_pos == m_count)
+        VerifyLast(false);
+      return true;
+    }
+    return false;
+  }
+
+  // returns the actual start index
+  virtual int First()
+  {
+    return m_first;
+  }
+
+  // returns the actual end index
+  virtual int Last()
+  {
+    return m_last;
+  }
+
+  // return the next available frame (or -1 if unknown -- this can happen in the
+  // multi-file image sequence case)
+  virtual int Next()
+  {
+    return m_pos;
+  }
+
+  virtual CvSize Size()
+  {
+    return m_size;
+  }
+
+  virtual ~SequenceReaderLibav()
+  {
+    Close();
+  }
+
+  bool Seek(int pos)
+  {
+    // restart from the closest keyframe (or from the beginning if there is no
+    // keyframe index) to seek backwards or to skip past the next keyframe
+    int start = Keyframe(pos);
+    if(pos < m_pos || start > m_pos)
+      Restart(start);
+
+    // seek forward to current position, if necessary
+    while(pos > m_pos && ReadNext());
+
+    // output error message if unsuccessful
+    if(pos != m_pos)
+    {
+      printf("SequenceReaderLibav::Seek: cannot seek to %i.\n", pos);
+      return false;
+    }
+    return true;
+  }
+
+private:
+  AVFormatContext * m_format;
+  AVCodecContext * m_codec;
+  AVPacket * m_packet;
+  AVFrame * m_frame;       // the last decoded frame
+  SwsContext * m_sws;      // converts decoded frames to the output format
+  int m_stream;            // index of the video stream
+  int m_first;
+  int m_last;
+  int m_requested_last;    // last frame requested by Open() (-1 if none)
+  int m_count;             // number of frames in the video
+  bool m_verified;         // true if m_count was checked by decoding
+  bool m_variable_rate;    // true if CreateIndex() found variable frame rate
+  int m_pos;
+  int64_t m_skip_pts;      // frames before this timestamp are skipped
+  CvSize m_size;
+  IplImage * m_image;      // describes the format of the decoded frames
+  int m_is_color;          // requested format (see PixelFormat())
+  SequenceBuffer m_buffer; // yuv420p frame (if not converted directly)
+  char * m_filename;
+  std::map<int, double> m_keyframes; // keyframe index -> timestamp
+};
+
+#endif // SEQUENCE_READER_LIBAV_H
@@ -22,7 +22,22 @@
 #define SEQUENCE_READER_MULTI_FILE_H
 
 #include "SequenceReader.h"
+#include "SequenceThreadPool.h"
+#include "SequenceBufferPool.h"
 #include "highgui.h"
+#include <limits.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#ifdef WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <dirent.h>
+#endif
 
 #ifndef strdup_safe
 #define strdup_safe(str) ((str) ? (strdup((str))) : NULL)
@@ -31,6 +46,10 @@
 //
 // reads an image sequence from a set of files
 //
+// If the first or last frame is not given (-1), the frames are found by
+// listing the directory of the filename pattern (e.g., dir/frame_%06i.png)
+// once, and the sequence spans the first to the last frame found.
+//
 class SequenceReaderMultiFile : public SequenceReader
 {
 public:
@@ -47,6 +66,7 @@ public:
   {
     free(m_filename);
     m_filename = NULL;
+    m_frames.clear();
     m_pos = 0; 
     m_first = -1;
     m_last = -1;
@@ -56,12 +76,32 @@ public:
 
   bool Open(const char * filename, int first, int last, int is_color)
   {
-    if((filename == NULL) || (first < 0) || (last < first))
+    if(filename == NULL)
       return false;
 
     m_filename = strdup_safe(filename);
+    if(first < 0 || last < 0)
+    {
+      // archive patterns (archive::pattern) are left to the archive reader
+      if(strchr(filename, '%') == NULL || strstr(filename, "::") || !Scan())
+        return false;
+      if(first < 0)
+        first = m_frames.front();
+      if(last < 0)
+        last = m_frames.back();
+      m_frames.erase(m_frames.begin(), std::lower_bound(
+        m_frames.begin(), m_frames.end(), first));
+      m_frames.erase(std::upper_bound(
+        m_frames.begin(), m_frames.end(), last), m_frames.end());
+      if(m_frames.empty())
+        return false;
+    }
+    if(last < first)
+      return false;
+
     m_first = first;
     m_last = last;
+    m_pos = first - 1;
     m_is_color = is_color;
 
     char temp_filename[1024];
@@ -90,6 +130,80 @@ public:
     return img;
   }
 
+  // reads the file of the frame and decodes it directly into dst
+  bool Read(int pos, IplImage * dst)
+  {
+    m_pos = pos;
+    return Load(pos, dst);
+  }
+
+  // loads and decodes the files of the requested frames in parallel
+  int ReadBatch(const int * positions, int n, void * dst, size_t stride)
+  {
+    std::vector<int> order = BatchOrder(positions, n);
+    std::vector<IplImage> headers;
+    int k = BatchHeaders(positions, order, dst, stride, headers);
+    if(k < 0)
+      return 0;
+    std::vector<char> loaded(n);
+    SequenceThreadPool::Instance().ParallelFor(n - k, [&](int i) {
+      loaded[k + i] = Load(positions[order[k + i]], &headers[k + i]);
+    });
+    int n_read = 1;
+    for(int j = k; j < n; j++)
+    {
+      if(loaded[j])
+        n_read++;
+      else
+        cvZero(&headers[j]);
+    }
+    m_pos = positions[order[n - 1]];
+    return n_read;
+  }
+
+  // reads the file of the frame at pos and decodes it into dst (can be
+  // called from several threads)
+  bool Load(int pos, IplImage * dst)
+  {
+    char temp_filename[1024];
+    sprintf(temp_filename, m_filename, pos);
+
+    FILE * fp = fopen(temp_filename, "rb");
+    if(fp == NULL)
+      return false;
+    SequenceBuffer buffer;
+    if(fseek(fp, 0, SEEK_END) == 0)
+    {
+      long size = ftell(fp);
+      rewind(fp);
+      if(size <= 0 || !buffer.Resize((size_t)size) ||
+         fread(buffer.Data(), 1, buffer.Size(), fp) != buffer.Size())
+        buffer.Resize(0);
+    }
+    fclose(fp);
+    return buffer.Size() > 0 &&
+      DecodeImage(buffer.Data(), buffer.Size(), m_is_color, dst);
+  }
+
+  // loads the files of the requested frames in parallel
+  int ReadRange(int first, int last, int step, IplImage ** images)
+  {
+    if(step <= 0)
+      return 0;
+    int n = first <= last ? (last - first) / step + 1 : 0;
+    SequenceThreadPool::Instance().ParallelFor(n, [&](int i) {
+      char temp_filename[1024];
+      sprintf(temp_filename, m_filename, first + i * step);
+      images[i] = cvLoadImage(temp_filename, m_is_color);
+    });
+    int n_read = 0;
+    for(int i = 0; i < n; i++)
+      n_read += images[i] != NULL;
+    if(n > 0)
+      m_pos = first + (n - 1) * step;
+    return n_read;
+  }
+
   // returns the actual start index
   int First()
   {
@@ -105,7 +219,11 @@ public:
   // return the next available frame (or -1 if unknown -- this can happen in the multi-file image sequence case)
   int Next()
   {
-    return -1;
+    if(m_frames.empty())
+      return -1;  // the directory was not listed
+    std::vector<int>::iterator it =
+      std::upper_bound(m_frames.begin(), m_frames.end(), m_pos);
+    return it != m_frames.end() ? *it : m_last + 1;
   }
 
   CvSize Size()
@@ -114,6 +232,92 @@ public:
   }
 
 private:
+  // Sets m_frames to the sorted indexes of the files in the directory of
+  // the pattern whose names the pattern produces. The names of large
+  // directories are matched by several threads.
+  bool Scan()
+  {
+    std::string pattern(m_filename);
+    size_t slash = pattern.find_last_of("/\\");
+    std::string dir = ".";
+    if(slash != std::string::npos)
+      dir = slash > 0 ? pattern.substr(0, slash) : "/";
+    std::string name_pattern = pattern.substr(
+      slash == std::string::npos ? 0 : slash + 1);
+    size_t percent = name_pattern.find('%');
+    size_t conversion = name_pattern.find_first_of("diu", percent);
+    if(dir.find('%') != std::string::npos || percent == std::string::npos ||
+       conversion == std::string::npos)
+      return false;
+    std::string prefix = name_pattern.substr(0, percent);
+    std::string suffix = name_pattern.substr(conversion + 1);
+
+    std::vector<std::string> names;
+    if(!ListDirectory(dir, names))
+      return false;
+
+    const size_t block = 4096;
+    std::vector<int> frames(names.size(), -1);
+    SequenceThreadPool::Instance().ParallelFor(
+      (int)((names.size() + block - 1) / block), [&](int b) {
+        size_t end = MIN(names.size(), (b + 1) * block);
+        for(size_t i = b * block; i < end; i++)
+          frames[i] = Match(names[i], name_pattern, prefix, suffix);
+      });
+
+    m_frames.clear();
+    for(size_t i = 0; i < frames.size(); i++)
+      if(frames[i] >= 0)
+        m_frames.push_back(frames[i]);
+    std::sort(m_frames.begin(), m_frames.end());
+    return !m_frames.empty();
+  }
+
+  // returns the frame index of the file name if the pattern produces the
+  // name, or -1 otherwise
+  static int Match(const std::string & name, const std::string & pattern,
+                   const std::string & prefix, const std::string & suffix)
+  {
+    if(name.size() <= prefix.size() + suffix.size() ||
+       name.compare(0, prefix.size(), prefix) != 0 ||
+       name.compare(name.size() - suffix.size(), suffix.size(), suffix) != 0)
+      return -1;
+    const char * digits = name.c_str() + prefix.size();
+    char * end = NULL;
+    long pos = strtol(digits, &end, 10);
+    if(end != name.c_str() + name.size() - suffix.size() || pos < 0 ||
+       pos > INT_MAX || name.size() >= 1024)
+      return -1;
+    char temp_filename[1024];
+    sprintf(temp_filename, pattern.c_str(), (int)pos);
+    return name == temp_filename ? (int)pos : -1;
+  }
+
+  // lists the names of the files in a directory
+  static bool ListDirectory(const std::string & dir,
+                            std::vector<std::string> & names)
+  {
+#ifdef WIN32
+    WIN32_FIND_DATAA data;
+    HANDLE find = FindFirstFileA((dir + "\\*").c_str(), &data);
+    if(find == INVALID_HANDLE_VALUE)
+      return false;
+    do
+      names.push_back(data.cFileName);
+    while(FindNextFileA(find, &data));
+    FindClose(find);
+#else
+    DIR * d = opendir(dir.c_str());
+    if(d == NULL)
+      return false;
+    struct dirent * entry;
+    while((entry = readdir(d)) != NULL)
+      names.push_back(entry->d_name);
+    closedir(d);
+#endif
+    return true;
+  }
+
   int m_pos;
   int m_first;
   int m_last;
@@ -122,6 +326,7 @@ private:
   CvCapture * m_video;
   char * m_filename;
   CvSize m_size;
+  std::vector<int> m_frames;  // frames found in the directory (if listed)
 };
 
 #endif // SEQUENCE_READER_MULTI_FILE_H
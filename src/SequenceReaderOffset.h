@@ -64,6 +64,13 @@ public:
     m_offset = 0;
   }
 
+  virtual bool Read(int pos, IplImage * dst)
+  {
+    if(m_reader)
+      return m_reader->Read(pos - m_offset, dst);
+    return false;
+  }
+
   virtual IplImage * Read(int pos)
   {
     if(m_reader)
@@ -71,6 +78,23 @@ public:
     return NULL;
   }
   
+  virtual int ReadRange(int first, int last, int step, IplImage ** images)
+  {
+    if(m_reader)
+      return m_reader->ReadRange(first - m_offset, last - m_offset, step, images);
+    return 0;
+  }
+
+  virtual int ReadBatch(const int * positions, int n, void * dst, size_t stride)
+  {
+    if(m_reader == NULL || n <= 0)
+      return 0;
+    std::vector<int> shifted(positions, positions + n);
+    for(int i = 0; i < n; i++)
+      shifted[i] -= m_offset;
+    return m_reader->ReadBatch(&shifted[0], n, dst, stride);
+  }
+
   virtual int First()
   {
     if(m_reader)
@@ -99,6 +123,13 @@ public:
     return cvSize(-1, -1);
   }
 
+  virtual int Keyframe(int pos)
+  {
+    if(m_reader)
+      return m_reader->Keyframe(pos - m_offset) + m_offset;
+    return pos;
+  }
+
   virtual ~SequenceReaderOffset()
   {
     Close();
@@ -0,0 +1,288 @@
+//
+// File: SequenceReaderPrefetch.h
+// Purpose: Wraps other readers and decodes the frames that follow the last
+//   frame read in background threads, so that sequential reads do not wait
+//   for the frames to be decoded.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#ifndef SEQUENCE_READER_PREFETCH_H
+#define SEQUENCE_READER_PREFETCH_H
+
+#include "SequenceReader.h"
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <map>
+#include <set>
+
+//
+// Each background thread reads from its own reader (all readers open the same
+// sequence), so that several frames can be decoded at the same time. Readers
+// that decode sequentially (ffmpeg) should use a single thread, since each
+// thread would otherwise decode all frames.
+//
+// The "n" prefetched frames are pos+step, ..., pos+n*step, where pos is the
+// last frame read, and step is the difference between the last two frames
+// read (or 1). Frames outside this window are discarded, so at most n frames
+// are buffered.
+//
+class SequenceReaderPrefetch : public SequenceReader
+{
+public:
+  SequenceReaderPrefetch(int n = 8, int n_threads = 1)
+    : m_n(MAX(n, 1)), m_n_threads(MAX(n_threads, 1)), m_first(-1),
+    m_last(-1), m_pos(-1), m_next(-1), m_start(-1), m_step(1), m_stop(false),
+    m_size(cvSize(0, 0))
+  {}
+
+  virtual bool Open(const char * filename, int first, int last, int is_color)
+  {
+    for(int i = 0; i < m_n_threads; i++)
+    {
+      SequenceReader * reader = Create(filename, first, last, is_color);
+      if(reader == NULL)
+      {
+        Close();
+        return false;
+      }
+      m_readers.push_back(reader);
+    }
+    m_first = m_readers[0]->First();
+    m_last = m_readers[0]->Last();
+    m_size = m_readers[0]->Size();
+    m_pos = m_first;
+    m_next = m_first;
+    m_start = m_first;
+    m_stop = false;
+
+    for(int i = 0; i < m_n_threads; i++)
+      m_threads.push_back(std::thread(&SequenceReaderPrefetch::Run, this, i));
+    return true;
+  }
+
+  virtual void Close()
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stop = true;
+    }
+    m_cond.notify_all();
+    for(size_t i = 0; i < m_threads.size(); i++)
+      m_threads[i].join();
+    m_threads.clear();
+
+    for(size_t i = 0; i < m_readers.size(); i++)
+      Destroy(&m_readers[i]);
+    m_readers.clear();
+
+    std::map<int, IplImage*>::iterator it;
+    for(it = m_frames.begin(); it != m_frames.end(); it++)
+      cvReleaseImage(&it->second);
+    m_frames.clear();
+    m_pending.clear();
+    m_failed.clear();
+    m_first = -1;
+    m_last = -1;
+    m_pos = -1;
+    m_next = -1;
+  }
+
+  // the returned image needs to be released by the caller!!
+  virtual IplImage * Read(int pos)
+  {
+    if(m_readers.empty())
+      return NULL;
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    // move the prefetch window so that it starts at pos
+    if(pos > m_pos)
+      m_step = pos - m_pos;
+    else if(pos < m_pos)
+      m_step = 1;
+    m_start = pos;
+    Discard();
+    m_cond.notify_all();
+
+    // wait for a background thread to read the frame (pos is the first frame
+    // in the window, so it is read before any other frame)
+    while(m_frames.find(pos) == m_frames.end() &&
+          m_failed.find(pos) == m_failed.end())
+      m_done.wait(lock);
+
+    IplImage * image = NULL;
+    std::map<int, IplImage*>::iterator it = m_frames.find(pos);
+    if(it != m_frames.end())
+    {
+      image = it->second;
+      m_frames.erase(it);
+    }
+    m_failed.erase(pos);
+
+    // prefetch the frames after pos
+    m_pos = pos;
+    m_next = pos + 1;
+    m_start = pos + m_step;
+    Discard();
+    m_cond.notify_all();
+    return image;
+  }
+
+  virtual int First()
+  {
+    return m_first;
+  }
+
+  virtual int Last()
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_last;
+  }
+
+  virtual int Next()
+  {
+    if(m_readers.empty())
+      return -1;
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_next;
+  }
+
+  virtual CvSize Size()
+  {
+    return m_size;
+  }
+
+  // the readers only differ in their position, so the first one is asked
+  // (between its reads, since a read can change its keyframe index)
+  virtual int Keyframe(int pos)
+  {
+    if(m_readers.empty())
+      return pos;
+    std::lock_guard<std::mutex> lock(m_reader_mutex);
+    return m_readers[0]->Keyframe(pos);
+  }
+
+  virtual ~SequenceReaderPrefetch()
+  {
+    Close();
+  }
+
+private:
+  // returns true if pos is one of the frames that should be prefetched (the
+  // first frame is always read, so that the reader can validate it)
+  bool InWindow(int pos)
+  {
+    if(pos == m_start)
+      return true;
+    int k = (pos - m_start) / m_step;
+    return pos > m_start && pos <= m_last && k < m_n &&
+      (pos - m_start) % m_step == 0;
+  }
+
+  // releases the frames outside of the prefetch window
+  void Discard()
+  {
+    std::map<int, IplImage*>::iterator it = m_frames.begin();
+    while(it != m_frames.end())
+    {
+      if(InWindow(it->first))
+        it++;
+      else
+      {
+        cvReleaseImage(&it->second);
+        m_frames.erase(it++);
+      }
+    }
+    m_failed.clear();
+  }
+
+  // returns the first frame in the window that is not read or being read
+  int NextToRead()
+  {
+    for(int k = 0; k < m_n; k++)
+    {
+      int pos = m_start + k * m_step;
+      if(k > 0 && pos > m_last)
+        break;
+      if(m_frames.find(pos) == m_frames.end() &&
+         m_pending.find(pos) == m_pending.end() &&
+         m_failed.find(pos) == m_failed.end())
+        return pos;
+    }
+    return -1;
+  }
+
+  // background thread that reads frames using the i-th reader
+  void Run(int i)
+  {
+    SequenceReader * reader = m_readers[i];
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while(!m_stop)
+    {
+      int pos = NextToRead();
+      if(pos < 0)
+      {
+        m_cond.wait(lock);
+        continue;
+      }
+
+      m_pending.insert(pos);
+      lock.unlock();
+      std::unique_lock<std::mutex> reader_lock(m_reader_mutex, std::defer_lock);
+      if(i == 0)
+        reader_lock.lock();
+      IplImage * image = reader->Read(pos);
+      int last = reader->Last();
+      if(i == 0)
+        reader_lock.unlock();
+      lock.lock();
+      m_pending.erase(pos);
+
+      // the reader may find out that the sequence length was not exact
+      m_last = last;
+
+      if(image == NULL)
+        m_failed.insert(pos);
+      else if(InWindow(pos))
+        m_frames[pos] = image;
+      else
+        cvReleaseImage(&image);
+      m_done.notify_all();
+    }
+  }
+
+  int m_n;
+  int m_n_threads;
+  int m_first;
+  int m_last;
+  int m_pos;    // last frame returned by Read()
+  int m_next;   // frame after the last frame returned by Read()
+  int m_start;  // first frame of the prefetch window
+  int m_step;   // step between frames in the prefetch window
+  bool m_stop;
+  CvSize m_size;
+  std::vector<SequenceReader*> m_readers;  // one reader per thread
+  std::vector<std::thread> m_threads;
+  std::map<int, IplImage*> m_frames;       // prefetched frames
+  std::set<int> m_pending;                 // frames being read
+  std::set<int> m_failed;                  // frames that could not be read
+  std::mutex m_mutex;
+  std::mutex m_reader_mutex;               // serializes Keyframe() with
+                                           // the reads of the first reader
+  std::condition_variable m_cond;          // signals threads to read
+  std::condition_variable m_done;          // signals that a frame was read
+};
+
+#endif // SEQUENCE_READER_PREFETCH_H
@@ -0,0 +1,144 @@
+//
+// File: SequenceThreadPool.h
+// Purpose: A minimal pool of worker threads used to decode/encode several
+//   frames at the same time.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#ifndef SEQUENCE_THREAD_POOL_H
+#define SEQUENCE_THREAD_POOL_H
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <deque>
+#include <vector>
+#include <stdlib.h>
+
+class SequenceThreadPool
+{
+public:
+  // n_threads <= 0 uses one thread per core
+  SequenceThreadPool(int n_threads = 0)
+    : m_stop(false)
+  {
+    if(n_threads <= 0)
+      n_threads = DefaultThreads();
+    for(int i = 0; i < n_threads; i++)
+      m_threads.push_back(std::thread(&SequenceThreadPool::Run, this));
+  }
+
+  ~SequenceThreadPool()
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stop = true;
+    }
+    m_cond.notify_all();
+    for(size_t i = 0; i < m_threads.size(); i++)
+      m_threads[i].join();
+  }
+
+  // the pool shared by all readers and writers; its size is set by the
+  // SEQUENCES_THREADS environment variable (default: one thread per core)
+  static SequenceThreadPool & Instance()
+  {
+    static SequenceThreadPool pool;
+    return pool;
+  }
+
+  static int DefaultThreads()
+  {
+    const char * env = getenv("SEQUENCES_THREADS");
+    int n = env ? atoi(env) : 0;
+    if(n <= 0)
+      n = (int)std::thread::hardware_concurrency();
+    return n > 0 ? n : 1;
+  }
+
+  int Size()
+  {
+    return (int)m_threads.size();
+  }
+
+  // queue a task to run on one of the threads
+  void Submit(const std::function<void()> & task)
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_tasks.push_back(task);
+    }
+    m_cond.notify_one();
+  }
+
+  // run func(0), ..., func(n-1) on the pool and wait until all are done (if
+  // called from one of the pool's threads, the calls run on that thread to
+  // avoid waiting for itself)
+  void ParallelFor(int n, const std::function<void(int)> & func)
+  {
+    if(n <= 1 || IsWorker())
+    {
+      for(int i = 0; i < n; i++)
+        func(i);
+      return;
+    }
+
+    std::mutex mutex;
+    std::condition_variable done;
+    int remaining = n;
+    for(int i = 0; i < n; i++)
+      Submit([&, i]() {
+        func(i);
+        std::lock_guard<std::mutex> lock(mutex);
+        if(--remaining == 0)
+          done.notify_one();
+      });
+    std::unique_lock<std::mutex> lock(mutex);
+    while(remaining > 0)
+      done.wait(lock);
+  }
+
+private:
+  static bool & IsWorker()
+  {
+    static thread_local bool is_worker = false;
+    return is_worker;
+  }
+
+  void Run()
+  {
+    IsWorker() = true;
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while(true)
+    {
+      while(!m_stop && m_tasks.empty())
+        m_cond.wait(lock);
+      if(m_tasks.empty())
+        return;
+      std::function<void()> task = m_tasks.front();
+      m_tasks.pop_front();
+      lock.unlock();
+      task();
+      lock.lock();
+    }
+  }
+
+  bool m_stop;
+  std::vector<std::thread> m_threads;
+  std::deque< std::function<void()> > m_tasks;
+  std::mutex m_mutex;
+  std::condition_variable m_cond;
+};
+
+#endif // SEQUENCE_THREAD_POOL_H
@@ -25,7 +25,7 @@
 #include "SequenceWriterMultiFile.h"
 #include "SequenceWriterArchive.h"
 
-SequenceWriter * SequenceWriter::Create(const char * filename, int fourcc, double fps, CvSize frame_size, int is_color)
+SequenceWriter * SequenceWriter::Create(const char * filename, int fourcc, double fps, CvSize frame_size, int is_color, int level)
 {
   SequenceWriter * writer;
 
@@ -40,7 +40,7 @@ SequenceWriter * SequenceWriter::Create(const char * filename, int fourcc, doubl
     delete writer;
 #endif
 
-  writer = new SequenceWriterArchive();
+  writer = new SequenceWriterArchive(level);
   if(writer->Open(filename, fourcc, fps, frame_size, is_color))
     return writer;
   else
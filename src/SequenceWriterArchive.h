@@ -27,13 +27,24 @@
 #include "archive_entry.h"
 #include "cv.h"
 #include "highgui.h"
+#include "SequenceThreadPool.h"
+#include "SequenceBufferPool.h"
+#include "ChunkedGzip.h"
+#ifdef USE_ZSTD
+#include "ChunkedZstd.h"
+#endif
+#include <deque>
+#include <string>
 
 class SequenceWriterArchive : public SequenceWriter
 {
 public:
-  SequenceWriterArchive()
+  // level < 0 uses the SEQUENCES_COMPRESSION_LEVEL environment variable
+  // (default: the compressor's default level)
+  SequenceWriterArchive(int level = -1)
     :m_pos(0), m_is_color(-1), m_filename(NULL), m_size(cvSize(0, 0)),
-      m_a(NULL)
+      m_a(NULL), m_chunked(NULL), m_entries(0), m_chunk_frames(30),
+      m_failed(false), m_pool(NULL), m_level(level)
   {}
 
   ~SequenceWriterArchive()
@@ -43,12 +54,28 @@ public:
 
   void Close()
   {
+    // write the frames that are still being encoded
+    Commit(0);
+    delete m_pool;
+    m_pool = NULL;
+    for(size_t i = 0; i < m_spare.size(); i++)
+      delete m_spare[i];
+    m_spare.clear();
+
     if(m_a)
     {
       archive_write_close(m_a);
       archive_write_free(m_a);
     }
     m_a = NULL;
+    if(m_chunked)
+    {
+      m_chunked->Close();
+      delete m_chunked;
+    }
+    m_chunked = NULL;
+    m_entries = 0;
+    m_failed = false;
     free(m_filename);
     m_filename = NULL;
     m_pos = 0; 
@@ -75,9 +102,9 @@ public:
     }
     else
     {
-      if((strcmp(filename + strlen(filename) - 7, ".tar.gz") == 0) ||
-         (strcmp(filename + strlen(filename) - 4, ".tgz") == 0) ||
-         (strcmp(filename + strlen(filename) - 4, ".tar") == 0))
+      if(EndsWith(filename, ".tar.gz") || EndsWith(filename, ".tgz") ||
+         EndsWith(filename, ".tar.zst") || EndsWith(filename, ".tzst") ||
+         EndsWith(filename, ".tar.lz4") || EndsWith(filename, ".tar"))
       {
         fprintf(stderr, 
                 "SequenceWriterArchive::Open(): please provide a file"
@@ -91,21 +118,64 @@ public:
     if(m_a == NULL)
       return false;
 
-    // currently only support tar and tar.gz files
-    if((strcmp(filename + strlen(filename) - 7, ".tar.gz") == 0) ||
-       (strcmp(filename + strlen(filename) - 4, ".tgz") == 0))
+    const char * env = getenv("SEQUENCES_COMPRESSION_LEVEL");
+    int level = m_level;
+    if(level < 0 && env && *env)
+      level = atoi(env);
+
+    // currently only support tar, tar.gz, tar.zst, and tar.lz4 files
+    archive_write_set_format_pax_restricted(m_a);
+    if(EndsWith(filename, ".tar.gz") || EndsWith(filename, ".tgz"))
+      m_chunked = new ChunkedGzipWriter();
+    else if(EndsWith(filename, ".tar.zst") || EndsWith(filename, ".tzst"))
     {
-      archive_write_add_filter_gzip(m_a);
-      archive_write_set_format_pax_restricted(m_a);
+#ifdef USE_ZSTD
+      m_chunked = new ChunkedZstdWriter(SequenceThreadPool::DefaultThreads());
+#elif ARCHIVE_VERSION_NUMBER >= 3003003
+      // without libzstd, the archive is compressed as a single zstd frame
+      // (readable, but not seekable)
+      archive_write_add_filter_zstd(m_a);
+      SetFilterOption("zstd", "compression-level", level);
+      SetFilterOption("zstd", "threads", SequenceThreadPool::DefaultThreads());
+#else
+      fprintf(stderr, "SequenceWriterArchive::Open(): writing tar.zst files "
+              "requires libzstd or libarchive 3.3.3\n");
+      return false;
+#endif
     }
-    else if(strcmp(filename + strlen(filename) - 4, ".tar") == 0)
+    else if(EndsWith(filename, ".tar.lz4"))
     {
-      archive_write_set_format_pax_restricted(m_a);
+#if ARCHIVE_VERSION_NUMBER >= 3002000
+      archive_write_add_filter_lz4(m_a);
+      SetFilterOption("lz4", "compression-level", level);
+#else
+      fprintf(stderr, "SequenceWriterArchive::Open(): writing tar.lz4 files "
+              "requires libarchive 3.2.0\n");
+      return false;
+#endif
     }
-    else
+    else if(!EndsWith(filename, ".tar"))
       return false;
 
-    if(archive_write_open_filename(m_a, filename) != ARCHIVE_OK)
+    int r;
+    if(m_chunked)
+    {
+      // compressed archives are compressed in chunks of frames, so that a
+      // reader can decompress any frame without decompressing the frames
+      // before it
+      env = getenv("SEQUENCES_CHUNK_FRAMES");
+      if(env && atoi(env) > 0)
+        m_chunk_frames = atoi(env);
+      if(!m_chunked->Open(filename, level))
+        return false;
+      // pass the tar data to the compressor right away, so that each chunk
+      // ends where an entry ends
+      archive_write_set_bytes_per_block(m_a, 0);
+      r = archive_write_open(m_a, m_chunked, NULL, ChunkedWrite, NULL);
+    }
+    else
+      r = archive_write_open_filename(m_a, filename);
+    if(r != ARCHIVE_OK)
       return false;
       
     m_filename = strdup_safe(filename);
@@ -117,33 +187,206 @@ public:
     return true;
   }
 
+  // Frames are encoded in parallel by the threads, but are written to the
+  // archive by the caller's thread in the order in which they were passed to
+  // Write(), so the archive is the same as if the frames were encoded on the
+  // caller's thread.
+  // The threads also compress tar.zst archives (if libzstd is available).
+  void SetThreads(int n_threads)
+  {
+    if(m_chunked)
+      m_chunked->SetThreads(n_threads);
+    Commit(0);
+    delete m_pool;
+    m_pool = n_threads > 0 ? new SequenceThreadPool(n_threads) : NULL;
+  }
+
+  // waits for the frames being encoded, and returns true if a frame could
+  // not be encoded or written
+  bool Failed()
+  {
+    Commit(0);
+    return m_failed;
+  }
+
   void Write(CvArr * image, int pos=-1)
   {
     if(pos >= 0)
      m_pos = pos;
     char filename[1024];
     sprintf(filename, m_pattern.c_str(), m_pos++);
-    CvMat * data = cvEncodeImage(filename, image, NULL);
-    int size = data->cols*data->rows;
+    time_t t = time(NULL);
+
+    // the encoded data is kept in reused buffers
+    if(m_pool == NULL)
+    {
+      if(!Encode(filename, image, m_data) || !WriteEntry(filename, m_data, t))
+        m_failed = true;
+      return;
+    }
+
+    // copy the image (into a buffer from the pool), since the caller may
+    // reuse it before it is encoded (the copy has a top-left origin)
+    CvMat stub;
+    CvMat * mat = cvGetMat(image, &stub);
+    Frame * frame = NewFrame();
+    frame->filename = filename;
+    frame->image = SequenceBufferPool::Instance().CreateMat(
+      mat->rows, mat->cols, CV_MAT_TYPE(mat->type));
+    if(frame->image && BottomLeft(image))
+      cvFlip(mat, frame->image, 0);
+    else if(frame->image)
+      cvCopy(mat, frame->image);
+    frame->t = t;
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_frames.push_back(frame);
+    }
+    m_pool->Submit([this, frame]() {
+      bool success = frame->image &&
+        Encode(frame->filename.c_str(), frame->image, frame->data);
+      std::lock_guard<std::mutex> lock(m_mutex);
+      frame->success = success;
+      frame->encoded = true;
+      m_encoded.notify_all();
+    });
+
+    // write the frames that are done, and limit the number of queued frames
+    Commit(2 * m_pool->Size());
+  }
+
+  // Writes the encoded frames at the front of the queue to the archive, and
+  // waits for frames to be encoded until at most max_queued frames are left.
+  void Commit(size_t max_queued)
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while(!m_frames.empty())
+    {
+      Frame * frame = m_frames.front();
+      if(!frame->encoded)
+      {
+        if(m_frames.size() <= max_queued)
+          break;
+        m_encoded.wait(lock);
+        continue;
+      }
+      m_frames.pop_front();
+      lock.unlock();
+      if(!frame->success ||
+         !WriteEntry(frame->filename.c_str(), frame->data, frame->t))
+        m_failed = true;
+      SequenceBufferPool::Instance().ReleaseMat(&frame->image);
+      lock.lock();
+      frame->encoded = false;
+      m_spare.push_back(frame);
+    }
+  }
+
+  // Appends the entries of the archive "filename" in the order in which
+  // they are stored, after the frames that were already written.
+  bool Append(const char * filename)
+  {
+    if(m_a == NULL)
+      return false;
+    Commit(0);
+    struct archive * a = archive_read_new();
+    archive_read_support_format_all(a);
+    archive_read_support_filter_all(a);
+    if(archive_read_open_filename(a, filename, 1 << 16) != ARCHIVE_OK)
+    {
+      printf("SequenceWriterArchive::Append(): could not open %s\n", filename);
+      archive_read_free(a);
+      return false;
+    }
+    // the archive was appended only if all entries were read up to the end
+    // of the archive (e.g., a truncated archive ends with ARCHIVE_FATAL)
+    struct archive_entry * entry;
+    bool success = true;
+    int r = ARCHIVE_OK;
+    while(success && (r = archive_read_next_header(a, &entry)) == ARCHIVE_OK)
+    {
+      la_int64_t size = archive_entry_size(entry);
+      m_data.resize((size_t)size);
+      success = size > 0 &&
+        archive_read_data(a, &m_data[0], (size_t)size) == (la_ssize_t)size &&
+        WriteEntry(archive_entry_pathname(entry), m_data,
+                   archive_entry_mtime(entry));
+    }
+    if(success && r != ARCHIVE_EOF)
+    {
+      printf("SequenceWriterArchive::Append(): could not read %s\n", filename);
+      success = false;
+    }
+    archive_read_free(a);
+    if(!success)
+      m_failed = true;
+    return success;
+  }
+
+  // returns true for images whose rows are stored bottom to top, which are
+  // flipped before they are encoded (as cvEncodeImage does)
+  static bool BottomLeft(CvArr * image)
+  {
+    return CV_IS_IMAGE(image) && ((IplImage*)image)->origin == IPL_ORIGIN_BL;
+  }
+
+  // encode an image into data (the format is given by the filename)
+  static bool Encode(const char * filename, CvArr * image,
+                     std::vector<uchar> & data)
+  {
+    bool success = false;
+    try
+    {
+      cv::Mat mat = cv::cvarrToMat(image);
+      if(BottomLeft(image))
+      {
+        cv::Mat flipped;
+        cv::flip(mat, flipped, 0);
+        mat = flipped;
+      }
+      success = cv::imencode(filename, mat, data);
+    }
+    catch(cv::Exception &)
+    {}
+    if(!success)
+      printf("SequenceWriterArchive::Write(): could not encode %s\n", filename);
+    return success;
+  }
+
+  // write an encoded image to the archive
+  // returns false if the entry could not be written
+  bool WriteEntry(const char * filename, const std::vector<uchar> & data,
+                  time_t t)
+  {
+    int size = (int)data.size();
     struct archive_entry * entry;
     entry = archive_entry_new();
     archive_entry_set_pathname(entry, filename);
     archive_entry_set_size(entry, size);
     archive_entry_set_filetype(entry, AE_IFREG);
     archive_entry_set_perm(entry, 0644);
-    time_t t = time(NULL);
     archive_entry_set_mtime(entry, t, 0);
     archive_entry_set_ctime(entry, t, 0);
     archive_entry_set_atime(entry, t, 0);
+    if(m_chunked && m_entries > 0 && m_entries % m_chunk_frames == 0)
+      m_chunked->EndChunk();
+    m_entries++;
+    bool success = true;
     int ret = archive_write_header(m_a, entry);
     if(ret != ARCHIVE_OK)
+    {
       printf("SequenceWriterArchive::Write(): "
              "archive_write_header(m_a, entry) != ARCHIVE_OK\n");
-    if(archive_write_data(m_a, data->data.ptr, size) != size)
+      success = false;
+    }
+    if(archive_write_data(m_a, &data[0], size) != size)
+    {
       printf("SequenceWriterArchive::Write(): "
-             "archive_write_data(m_a, data->data.ptr, size) != size\n");
+             "archive_write_data(m_a, &data[0], size) != size\n");
+      success = false;
+    }
     archive_entry_free(entry);
-    cvReleaseMat(&data);
+    return success;
   }
 
   // return the index of the next frame that will be written
@@ -157,12 +400,76 @@ public:
     return m_size;
   }
 
+  static bool EndsWith(const char * filename, const char * ext)
+  {
+    size_t len = strlen(filename), ext_len = strlen(ext);
+    return len >= ext_len && strcmp(filename + len - ext_len, ext) == 0;
+  }
+
+  // set an option of a libarchive filter (ignored if value < 0, or if the
+  // installed libarchive does not support it)
+  void SetFilterOption(const char * filter, const char * option, int value)
+  {
+    char str[32];
+    if(value < 0)
+      return;
+    sprintf(str, "%i", value);
+    archive_write_set_filter_option(m_a, filter, option, str);
+  }
+
+  // libarchive callback that compresses the tar data
+  static la_ssize_t ChunkedWrite(struct archive * a, void * client,
+                                 const void * buffer, size_t size)
+  {
+    if(!((ChunkedWriter*)client)->Write(buffer, size))
+    {
+      archive_set_error(a, -1, "could not write compressed data");
+      return -1;
+    }
+    return (la_ssize_t)size;
+  }
+
   int m_pos;
   int m_is_color;
   char * m_filename;
   std::string m_pattern;
   struct archive * m_a;
   CvSize m_size;
+  ChunkedWriter * m_chunked;  // compressor of tar.gz and tar.zst files
+  int m_entries;              // number of entries written
+  int m_chunk_frames;         // frames per compressed chunk
+  bool m_failed;              // true if a frame could not be written
+
+  // a frame queued for encoding
+  struct Frame
+  {
+    Frame() : image(NULL), t(0), encoded(false), success(false) {}
+    std::string filename;
+    CvMat * image;
+    std::vector<uchar> data;  // encoded image
+    time_t t;
+    bool encoded;
+    bool success;
+  };
+  std::vector<uchar> m_data;    // encoded image (if there are no threads)
+  SequenceThreadPool * m_pool;
+  int m_level;                  // compression level (< 0: default)
+  std::deque<Frame*> m_frames;  // frames in the order they are written
+  std::vector<Frame*> m_spare;  // written frames, reused for new frames
+  std::mutex m_mutex;
+  std::condition_variable m_encoded;
+
+  // returns a frame from the spare frames, whose buffers have already been
+  // allocated by previous frames, or a new frame (m_mutex must be unlocked)
+  Frame * NewFrame()
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if(m_spare.empty())
+      return new Frame();
+    Frame * frame = m_spare.back();
+    m_spare.pop_back();
+    return frame;
+  }
 };
 
 #endif // SEQUENCE_WRITER_ARCHIVE_H
@@ -32,7 +32,8 @@ class SequenceWriterMultiFile : public SequenceWriter
 {
 public:
   SequenceWriterMultiFile()
-    : m_pos(0), m_is_color(-1), m_filename(NULL), m_size(cvSize(0,0))
+    : m_pos(0), m_is_color(-1), m_filename(NULL), m_size(cvSize(0,0)),
+      m_failed(false)
   {}
 
   ~SequenceWriterMultiFile()
@@ -47,6 +48,7 @@ public:
     m_pos = 0; 
     m_is_color = -1;
     m_size = cvSize(0,0);
+    m_failed = false;
   }
 
   bool Open(const char * filename, int fourcc, double fps, CvSize frame_size, int is_color=1)
@@ -87,7 +89,20 @@ public:
       m_pos = pos;
     char filename[1024];
     sprintf(filename, m_filename, m_pos++);
-    cvSaveImage(filename, image);    
+    bool success = false;
+    try
+    {
+      success = cvSaveImage(filename, image) != 0;
+    }
+    catch(...)
+    {}
+    if(!success)
+      m_failed = true;
+  }
+
+  bool Failed()
+  {
+    return m_failed;
   }
 
   // return the index of the next frame that will be written
@@ -105,6 +120,7 @@ public:
   int m_is_color;
   char * m_filename;
   CvSize m_size;
+  bool m_failed;  // true if a frame could not be written
 };
 
 #endif // SEQUENCE_WRITER_MULTI_FILE_H
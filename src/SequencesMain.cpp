@@ -22,7 +22,10 @@
 #include "highgui.h"
 #include "SequenceReader.h"
 #include "SequenceWriter.h"
+#include "SequenceReaderCache.h"
+#include <string>
 #include <vector>
+#include <thread>
 
 typedef struct MergeStruct
 {
@@ -43,6 +46,10 @@ void ParseCmdLineParameters(int argc, char * argv[],
                              int * last, 
                              int * step, 
                              int * is_color,
+                             int * prefetch,
+                             int * prefetch_threads,
+                             int * encode_threads,
+                             int * segments,
                              std::vector< MergeStruct > & merge_list)
 {
   // parse command line arguments
@@ -81,6 +88,25 @@ void ParseCmdLineParameters(int argc, char * argv[],
         *output = argv[i+1];
         i += 2;
         continue;
+      case 'p': // prefetch
+        if(i+2 >= argc)
+          break;
+        *prefetch = atoi(argv[i+1]);
+        *prefetch_threads = atoi(argv[i+2]);
+        i += 3;
+        continue;
+      case 'e': // encode threads
+        if(i+1 >= argc)
+          break;
+        *encode_threads = atoi(argv[i+1]);
+        i += 2;
+        continue;
+      case 'j': // segments converted in parallel
+        if(i+1 >= argc)
+          break;
+        *segments = atoi(argv[i+1]);
+        i += 2;
+        continue;
       case 'f': // frames
         if(i+3 >= argc)
           break;
@@ -130,6 +156,16 @@ void ParseCmdLineParameters(int argc, char * argv[],
     printf("              video.  This is option is ignored if -o is not specified.\n");
     printf("   -c is_color (optional) if 0, force to 8-bit single channel; else\n");
     printf("              if 1, force to 24-bit bgr; if -1 auto-select.\n");
+    printf("   -p n threads (optional) when writing output, decode the next n\n");
+    printf("              input frames in the background using the given number\n");
+    printf("              of threads (default: 8 1; use 0 0 to disable).\n");
+    printf("   -e threads (optional) number of threads that encode output frames\n");
+    printf("              (default: one per core; 0 encodes on the main thread).\n");
+    printf("   -j segments (optional) when writing output, split the input into\n");
+    printf("              this many segments that start at keyframes, and decode\n");
+    printf("              and encode each segment on its own thread (default: 1).\n");
+    printf("              Segments of archives are written to temporary .tar\n");
+    printf("              files next to the output and appended to it in order.\n");
     exit(1);
     i++;
   }
@@ -220,6 +256,138 @@ void ViewSequence(SequenceReader * reader, int step)
   }
 }
 
+// returns the first frames of at most n segments of first..last that start at
+// keyframes (fewer segments if the reader cannot start at other frames)
+std::vector<int> SegmentStarts(SequenceReader * reader, int first, int last,
+                               int n)
+{
+  std::vector<int> starts(1, first);
+  for(int k = 1; k < n; k++)
+  {
+    int pos = reader->Keyframe(first + (int)((int64)(last - first + 1) * k / n));
+    if(pos > starts.back() && pos <= last)
+      starts.push_back(pos);
+  }
+  return starts;
+}
+
+// returns the name of the temporary archive that the k-th segment of an
+// archive output (archive::pattern) is written to
+std::string SegmentOutput(const char * output, int k)
+{
+  std::string name(output);
+  char suffix[32];
+  sprintf(suffix, ".seg%i.tar", k);
+  return name.insert(name.find("::"), suffix);
+}
+
+// reads frames first..last of the input with a new reader and writes them;
+// sets *success to false if a frame could not be read or written
+void WriteSegment(const char * input, int first, int last, int is_color,
+                  SequenceWriter * writer, char * success)
+{
+  *success = false;
+  SequenceReader * reader = SequenceReader::Create(input, first, last, is_color);
+  if(reader == NULL)
+  {
+    printf("Could not open segment %i-%i!\n", first, last);
+    return;
+  }
+  bool read = true;
+  for(int frame_i = first; frame_i <= last; frame_i++)
+  {
+    IplImage * image = reader->Read(frame_i);
+    if(image)
+      writer->Write(image, frame_i);
+    else
+    {
+      printf("Could not read frame %i!\n", frame_i);
+      read = false;
+    }
+    cvReleaseImage(&image);
+  }
+  SequenceReader::Destroy(&reader);
+  *success = read && !writer->Failed();
+}
+
+// Writes frames first..last of the input in n segments that start at
+// keyframes, each decoded and encoded on its own thread. The first segment is
+// written by the output writer; the other segments of an archive are written
+// to temporary archives and appended to the output in order, while the other
+// segments of an image sequence are written directly to the output files.
+// Returns 1 if the segments were written, 0 if the segment writers cannot be
+// created (nothing is written), and -1 if a segment cannot be written or
+// appended (the temporary archives of the segments that were not appended
+// are kept).
+int WriteSegments(const char * input, int first, int last, int is_color,
+                  SequenceReader * reader, SequenceWriter * writer,
+                  const char * output, int n)
+{
+  std::vector<int> starts = SegmentStarts(reader, first, last, n);
+  bool archive = strstr(output, "::") != NULL;
+  std::vector<SequenceWriter*> writers(1, writer);
+  std::vector<std::string> outputs(1, output);
+  for(size_t k = 1; k < starts.size(); k++)
+  {
+    outputs.push_back(archive ? SegmentOutput(output, (int)k) : output);
+    writers.push_back(SequenceWriter::Create(outputs[k].c_str(), 0, 30,
+                                             reader->Size(), is_color));
+    if(writers.back() == NULL)
+    {
+      printf("Could not create segment writer %s!\n", outputs[k].c_str());
+      for(size_t j = 1; j < writers.size(); j++)
+        SequenceWriter::Destroy(&writers[j]);
+      return 0;
+    }
+  }
+
+  printf("Segments:");
+  for(size_t k = 0; k < starts.size(); k++)
+    printf(" %i", starts[k]);
+  printf("\n");
+  fflush(stdout);
+
+  std::vector<std::thread> threads;
+  std::vector<char> written(starts.size(), 0);
+  for(size_t k = 0; k < starts.size(); k++)
+  {
+    int segment_last = (k + 1 < starts.size()) ? starts[k + 1] - 1 : last;
+    threads.push_back(std::thread(WriteSegment, input, starts[k],
+                                  segment_last, is_color, writers[k],
+                                  &written[k]));
+  }
+
+  // append the segments in order as they are done (after a segment cannot be
+  // written or appended, the following segments are not appended either)
+  bool appended = true;
+  for(size_t k = 0; k < threads.size(); k++)
+  {
+    threads[k].join();
+    if(!written[k])
+    {
+      printf("Could not write segment %i!\n", (int)k);
+      appended = false;
+    }
+    if(k == 0)
+      continue;
+    SequenceWriter::Destroy(&writers[k]);  // finishes the temporary archive
+    if(archive)
+    {
+      std::string filename = outputs[k].substr(0, outputs[k].find("::"));
+      if(appended && !writer->Append(filename.c_str()))
+      {
+        printf("Could not append segment %i!\n", (int)k);
+        appended = false;
+      }
+      if(appended)
+        remove(filename.c_str());
+      else
+        printf("Segment %i is kept in %s.\n", (int)k, filename.c_str());
+    }
+  }
+  return appended ? 1 : -1;
+}
+
 int main(int argc, char * argv[])
 {
   char * input = NULL;
@@ -229,8 +397,19 @@ int main(int argc, char * argv[])
   int step = 1;
   std::vector< MergeStruct > merge_list;
   int is_color = -1;
+  int prefetch = 8;
+  int prefetch_threads = 1;
+  int encode_threads = (int)std::thread::hardware_concurrency();
+  int segments = 1;
+
+  ParseCmdLineParameters(argc, argv, &input, &output, &first, &last, &step, &is_color,
+                         &prefetch, &prefetch_threads, &encode_threads, &segments,
+                         merge_list);
 
-  ParseCmdLineParameters(argc, argv, &input, &output, &first, &last, &step, &is_color, merge_list);
+  // segments cannot be written in parallel to a single-file sequence
+  if(output && segments > 1 && strstr(output, "::") == NULL &&
+     strstr(output, "%") == NULL)
+    segments = 1;
 
   printf("Input: %s\n", (input ? input : "(NULL)"));
   printf("Frames: %i %i %i\n", first, last, step);
@@ -241,7 +420,18 @@ int main(int argc, char * argv[])
   printf("\n");
   fflush(stdout);
   
-  SequenceReader * reader = SequenceReader::Create(input, first, last, is_color);
+  // when converting, decode frames in the background while they are written
+  // (segments are decoded by their own readers instead)
+  if(output == NULL || segments > 1)
+    prefetch = 0;
+  // when viewing, keep recently displayed frames so that seeking back to
+  // them does not decode them again
+  SequenceReader * reader = (output == NULL) ?
+    SequenceReader::CreateCache(input, first, last, is_color,
+                                SequenceReaderCache::DefaultMaxBytes()) :
+    (prefetch > 0 && prefetch_threads > 0) ?
+    SequenceReader::CreatePrefetch(input, first, last, is_color, prefetch, prefetch_threads) :
+    SequenceReader::Create(input, first, last, is_color);
   if(reader == NULL)
   {
     printf("Could not open sequence!\n");
@@ -264,14 +454,25 @@ int main(int argc, char * argv[])
     writer = SequenceWriter::Create(output, 0, 30, reader->Size(), is_color);
     if(writer == NULL)
       printf("Could not create output sequence writer!\n");
+    else
+      writer->SetThreads(encode_threads);
   }
 
   // if the writer was successfully created, write the video and merge any
   // other videos if they exist
   if(writer != NULL)
   {
-    // write first video
-    for(int frame_i = first; frame_i <= last; frame_i++)
+    // write first video (in parallel segments, if requested)
+    int written = segments > 1 ?
+      WriteSegments(input, first, last, is_color, reader, writer, output,
+                    segments) : 0;
+    if(written < 0)
+    {
+      SequenceReader::Destroy(&reader);
+      delete writer;
+      return 1;
+    }
+    for(int frame_i = first; frame_i <= last && !written; frame_i++)
     {
       IplImage * image = reader->Read(frame_i);
       writer->Write(image, frame_i);
@@ -286,7 +487,10 @@ int main(int argc, char * argv[])
         delete reader;
 
       // open next sequence
-      SequenceReader * reader = SequenceReader::Create(merge_list[merge_i].filename, merge_list[merge_i].first, merge_list[merge_i].last, is_color);
+      const MergeStruct & merge = merge_list[merge_i];
+      SequenceReader * reader = (prefetch > 0 && prefetch_threads > 0) ?
+        SequenceReader::CreatePrefetch(merge.filename, merge.first, merge.last, is_color, prefetch, prefetch_threads) :
+        SequenceReader::Create(merge.filename, merge.first, merge.last, is_color);
       if(reader == NULL)
       {
         printf("Could not open sequence %i for merging!\n", merge_i);